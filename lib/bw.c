@@ -25,6 +25,7 @@ struct bw_t {
 
   /* wake mode */
   int seqno;
+  int next;
   int fd[BW_WAITMAX];
   char name[BW_WAITMAX][BW_NAMELEN];
   char zero;
@@ -34,6 +35,8 @@ struct bw_t {
   int listenfd;
   int selffd;
   int epollfd;
+  int ready;      /* listenfd readable: 1, not: 0, unknown: -1 */
+  unsigned seen;  /* our slot's wakeup gen when ready was known */
   char discard[8];
   struct mmsghdr *drain;
 
@@ -366,6 +369,7 @@ bw_t * bw_open(int flags, bw_handle *h, ...) {
   w->listenfd = -1;
   w->selffd = -1;
   w->epollfd = -1;
+  w->ready = -1;
 
   sc = prune_handle(h);
   if (sc < 0) goto done;
@@ -517,6 +521,7 @@ int bw_ready_ul(bw_t *w) {
     bw_log("wakeup\n");
   }
 
+  w->ready = -1;
   nr = recvmsg(w->listenfd, &w->hdr, MSG_DONTWAIT);
   if (nr < 0) {
     if ((errno != EWOULDBLOCK) && (errno != EAGAIN)) {
@@ -554,6 +559,23 @@ int bw_ready_ul(bw_t *w) {
  *
  */
 int bw_wait_ul(bw_t *w) {
+  return bw_timedwait_ul(w, -1);
+}
+
+/*
+ * bw_timedwait_ul
+ *
+ * bw_wait_ul, waiting at most ms milliseconds (-1 for no limit)
+ *
+ * call WITHOUT handle under lock
+ *
+ * returns 0 on success
+ *        -1 on error
+ *        -2 timed out
+ *        -3 other descriptor ready (see bw_ctl BW_POLLFD)
+ *
+ */
+int bw_timedwait_ul(bw_t *w, int ms) {
   struct epoll_event ev;
   int rc = -1, sc;
 
@@ -568,12 +590,17 @@ int bw_wait_ul(bw_t *w) {
   /* wait for listenfd to become readable.
    * other descriptors may also be in the
    * epoll set if bw_ctl(BW_POLLFD) used */
-  sc = epoll_wait(w->epollfd, &ev, 1, -1);
+  sc = epoll_wait(w->epollfd, &ev, 1, ms);
   if (sc < 0) {
     bw_log("epoll_wait: %s\n", strerror(errno));
     goto done;
   }
 
+  if (sc == 0) {
+    rc = -2;
+    goto done;
+  }
+
   assert(sc == 1);
 
   /* "other" descriptor is ready */
@@ -597,17 +624,23 @@ int bw_wait_ul(bw_t *w) {
  * send wake up byte one waiting socket
  * if it errors out for anything but ewouldblock/eagain
  * disconnect from that socket and zero its slot
+ *
+ * returns 0 if the waiter is awake (or has a wakeup pending)
+ *        -1 if it's gone
  */
-static void wake_one(bw_t *w, int n) {
+static int wake_one(bw_t *w, int n) {
   ssize_t nr;
 
   if (w->flags & BW_TRACE) {
     bw_log("waking %s\n", w->name[n]);
   }
 
+  /* the waiter's generation is odd while we send, see bw_force.
+   * wakers hold the handle lock, so one at a time bumps it */
+  __atomic_add_fetch(&w->h->wr[n].gen, 1, __ATOMIC_SEQ_CST);
   nr = sendmsg(w->fd[n], &w->hdr, MSG_DONTWAIT);
-  if (nr >= 0) return;
-  if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) return;
+  __atomic_add_fetch(&w->h->wr[n].gen, 1, __ATOMIC_SEQ_CST);
+  if ((nr >= 0) || (errno == EWOULDBLOCK) || (errno == EAGAIN)) return 0;
 
   if (w->flags & BW_TRACE) {
     bw_log("purge %s: %s\n", w->name[n], strerror(errno));
@@ -616,6 +649,7 @@ static void wake_one(bw_t *w, int n) {
   w->fd[n] = -1;
   w->h->seqno++;
   w->h->wr[n].pid = 0;
+  return -1;
 }
 
 /*
@@ -630,20 +664,44 @@ static void wake_one(bw_t *w, int n) {
  *
  */
 int bw_wake(bw_t *w) {
-  int n, rc = -1;
+  return (bw_wake_n(w, BW_WAITMAX, NULL) < 0) ? -1 : 0;
+}
 
-  assert(w->flags & BW_WAKE);
-  if (bw_sync(w) < 0) goto done;
+/*
+ * bw_wake_n
+ *
+ * invoked by the wake-mode caller to wake up to n of the waiters,
+ * taking turns: each call starts past the last waiter woken by the
+ * previous one (on this handle). if left is given, it gets the
+ * number of waiters left unwoken.
+ *
+ * call WITH handle under lock
+ *
+ * returns number of waiters woken (0 to n) on success
+ *        -1 on error
+ *
+ */
+int bw_wake_n(bw_t *w, int n, int *left) {
+  int i, k, start, woken = 0;
 
-  for(n = 0; n < BW_WAITMAX; n++) {
-    if (w->fd[n] == -1) continue;
-    wake_one(w,n);
+  assert(w->flags & BW_WAKE);
+  if (bw_sync(w) < 0) return -1;
+  if (left) *left = 0;
+
+  start = w->next;
+  for(i = 0; i < BW_WAITMAX; i++) {
+    k = (start + i) % BW_WAITMAX;
+    if (w->fd[k] == -1) continue;
+    if (woken == n) {
+      if (left) (*left)++;
+      continue;
+    }
+    if (wake_one(w,k) < 0) continue;
+    w->next = (k + 1) % BW_WAITMAX;
+    woken++;
   }
 
-  rc = 0;
-
- done:
-  return rc;
+  return woken;
 }
 
 /*
@@ -703,20 +761,43 @@ static int drain_msgs(bw_t *w) {
  * available underlying resource, it can ensure
  * it gets awakened immediately again.
  *
+ * the readiness is remembered, along with the
+ * wakeup generation of our slot at the time.
+ * while no wakeup has been sent to us since,
+ * the fd is as we left it, so a call that does
+ * not change it costs no system calls. only a
+ * change (a send to ourselves, or a drain) or
+ * an intervening wakeup touches the socket.
+ * the generation is odd while a wakeup is in
+ * flight; then the state is unknown, as well.
+ *
+ * since a set fd is left alone, rather than
+ * sent another byte, an edge-triggered poller
+ * sees an edge only on a wakeup or on forcing
+ * a cleared fd ready; it must consume until
+ * it clears the fd, as epoll's EPOLLET needs.
+ *
  */
-#define DRAIN_MSGS 1024
 int bw_force(bw_t *w, int want_ready) {
   int rc = -1, have_ready, sc;
   char c = '*';
+  unsigned g;
   ssize_t nr;
 
   assert(w->flags & BW_WAIT);
 
-  sc = ioctl(w->listenfd, FIONREAD, &have_ready);
-  if (sc < 0) {
-    bw_log("ioctl: %s\n", strerror(errno));
-    goto done;
+  want_ready = want_ready ? 1 : 0;
+  g = __atomic_load_n(&w->h->wr[ w->slotno ].gen, __ATOMIC_SEQ_CST);
+  if ((w->ready != -1) && (g == w->seen) && ((g & 1) == 0)) {
+    have_ready = w->ready;
+  } else {
+    sc = ioctl(w->listenfd, FIONREAD, &have_ready);
+    if (sc < 0) {
+      bw_log("ioctl: %s\n", strerror(errno));
+      goto done;
+    }
   }
+  w->ready = -1;
 
   if ((want_ready == 0) && (have_ready > 0)) {
     sc = drain_msgs(w);
@@ -731,6 +812,8 @@ int bw_force(bw_t *w, int want_ready) {
     }
   }
 
+  w->ready = want_ready;
+  w->seen = g;
   rc = 0;
 
  done:
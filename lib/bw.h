@@ -28,6 +28,7 @@ struct bw_handle {
   struct {
     pid_t pid;
     char name[BW_NAMELEN];
+    unsigned gen;  /* bumped by each wakeup sent to it */
   } wr[BW_WAITMAX];
 };
 
@@ -43,10 +44,12 @@ typedef struct bw_handle bw_handle;
 /* API */
 bw_t * bw_open(int flags, bw_handle *h, ...); /* CALL WITH HANDLE UNDER LOCK */
 int bw_wake(bw_t *w);                         /* CALL WITH HANDLE UNDER LOCK */
+int bw_wake_n(bw_t *w, int n, int *left);     /* CALL WITH HANDLE UNDER LOCK */
 void bw_close(bw_t *w);                       /* CALL WITH HANDLE UNDER LOCK */
 int bw_force(bw_t *w, int ready);             /* CALL WITH HANDLE UNDER LOCK */
 int bw_ready_ul(bw_t *w);                     /* call WITHOUT lock on handle */
 int bw_wait_ul(bw_t *w);                      /* call WITHOUT lock on handle */
+int bw_timedwait_ul(bw_t *w, int ms);         /* call WITHOUT lock on handle */
 int bw_ctl(bw_t *w, int flag, ...);           /* call WITHOUT lock on handle */
 
 #if defined __cplusplus
@@ -7,12 +7,22 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/vfs.h>
+#include <linux/futex.h>
+#include <linux/magic.h>
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
 #include <errno.h>
 #include <stdio.h>
 #include "shr.h"
@@ -21,36 +31,131 @@
 #define CREAT_MODE 0644
 #define MIN_RING_SZ (sizeof(shr_ctrl) + 1)
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+
+/* the flags shr_init takes: those below the fence, and SHR_HUGEPAGE,
+ * which came after the open and ctl flags had the bits above it */
+#define INIT_FLAGS ((SHR_OPEN_FENCE-1) | SHR_HUGEPAGE)
 
 struct msg {
-  size_t pos;
+  size_t pos;               /* SHR_MP: bytes reserved before it, ever */
   size_t len;
+  size_t volatile c;        /* slot state; SHR_MP: sequence number + 1 */
+  size_t volatile o;        /* client id of the slot's owner, in flight */
 };
 
+/* states of a slot (struct msg c) while its message is in flight.
+ * not used in SHR_SPSC mode. SHR_MP uses c in its own way. the client
+ * (id_claim) that puts a slot in flight records itself as its owner,
+ * so that if it dies there, others can tell, and recover the slot */
+#define SLOT_READY   0      /* message committed (or no message) */
+#define SLOT_WRITING 1      /* writer copying message in, without lock */
+#define SLOT_READING 2      /* reader copying message out, without lock */
+#define SLOT_VOID    3      /* message given up by its writer; skipped */
+
+/* in SHR_MP mode, c of a void slot: its sequence number + 1, and this */
+#define MP_VOID (((size_t)1) << (sizeof(size_t) * 8 - 1))
+
 /* shr_ctrl is the control region of the shared/multiprocess ring.
  * this struct is mapped to the beginning of the mmap'd ring file.
- * the volatile offsets constantly change, under posix file lock,
- * as other processes copy data in or out of the ring. 
+ * the volatile offsets constantly change, under the ring lock,
+ * as other processes copy data in or out of the ring. the ring
+ * lock is a posix file lock, or the mutexes below (SHR_MUTEX).
+ *
+ * the fields are grouped by who writes them: fixed at creation,
+ * each lock, the writer side, the reader side, the counts both
+ * sides update, the stats, and the wait handles. each group starts
+ * a cache line (CACHE_LINE spans two 64-byte lines, as cpus fetch
+ * adjacent lines in pairs), so a reader moving its offsets doesn't
+ * steal the line a writer on another core is using, and vice versa.
+ * the ring data d[] starts on a page of its own (DATA_ALIGN), so that
+ * it can be mapped a second time, right after itself (SHR_MIRROR).
  */
-static char magic[] = "libshr5";
+#define CACHE_LINE 128
+#define LINE __attribute__((aligned(CACHE_LINE)))
+#define DATA_ALIGN 4096
+static char magic[] = "libshr22";
+
+/* i/o counters of one client (an open handle). each client counts
+ * in a slot of its own, on its own cache line. shr_stat adds them up.
+ * clients beyond STAT_SLOTS share one, as do clients that closed */
+#define STAT_SLOTS 128
+struct stat_slot {
+  LINE
+  size_t cid;               /* owner's client id, 0 if free         */
+  pid_t pid;                /* owner's pid, in its pid namespace    */
+  unsigned flags;           /* owner's SHR_RDONLY or SHR_WRONLY     */
+  size_t bw, br;            /* bytes written to/read from ring      */
+  size_t mw, mr;            /* messages written to/read from ring   */
+  size_t md, bd;            /* in drop mode: msgs/bytes dropped     */
+  size_t wm_m, wm_b;        /* owner's read watermarks: msgs, bytes */
+  unsigned long long wm_ns; /* owner's read watermark: max delay    */
+};
+
 typedef struct {
   char magic[sizeof(magic)];
+  size_t          ctrl_len; /* sizeof(shr_ctrl) of the creator      */
   unsigned        gflags;   /* global flags, fixed at creation      */
   size_t          n;        /* allocd size, fixed at creation       */
+  size_t          mm;       /* max number of messages (mv slots)    */
+  size_t          mv_len;   /* message vector len, located after d  */
+  size_t          pad_len;  /* padding after data to align mv; in
+                               SHR_MIRROR mode, room for the mirror */
+  size_t          app_len;  /* len of app region after mv - opaque  */
+  size_t          hp;       /* SHR_HUGEPAGE: huge page size, else 0 */
+  size_t          wcid;     /* SHR_SPSC: client id of the writer    */
+  size_t          rcid;     /* SHR_SPSC: client id of the reader    */
+
+  LINE
+  pthread_mutex_t mtx;      /* ring lock in SHR_MUTEX mode (writer) */
+  LINE
+  pthread_mutex_t rmtx;     /* ring lock in SHR_MUTEX mode (reader) */
+
+  /* writer side */
+  LINE
   size_t volatile i;        /* offset from r->d for next write      */
-  size_t volatile u;        /* current number of unread bytes       */
-  size_t volatile m;        /* current number of unread messages    */
   size_t volatile mp;       /* msgs present in ring, unread + read  */
-  size_t volatile r;        /* slot number in mv for next read      */
   size_t volatile e;        /* slot number in mv of eldest message  */
   size_t volatile q;        /* sequence number of eldest message    */
-  struct shr_stat stat;     /* i/o stats                            */
-  size_t mm;                /* max number of messages (mv slots)    */
-  size_t mv_len;            /* message vector len, located after d  */
-  size_t pad_len;           /* padding after data to align mv       */
-  size_t app_len;           /* len of app region after mv - opaque  */
+  int volatile    wwait;    /* a writer waits for space; wake it    */
+  size_t volatile wn_b;     /* bytes free a waiting writer needs    */
+  size_t volatile wn_m;     /* slots free a waiting writer needs    */
+  int volatile    wgen;     /* SHR_FUTEX: reader wake generation    */
+  size_t volatile ws;       /* SHR_MP: slots reserved, ever         */
+
+  /* reader side */
+  LINE
+  size_t volatile r;        /* slot number in mv for next read      */
+  int volatile    rwait;    /* a reader waits for data; wake it     */
+  int volatile    rwm;      /* a reader waits for a watermark       */
+  size_t volatile wm_m;     /* lowest reader watermark, msgs        */
+  size_t volatile wm_b;     /* lowest reader watermark, bytes       */
+  unsigned long long volatile wm_ns; /* lowest, max delay (ns)     */
+  int volatile    rgen;     /* SHR_FUTEX: writer wake generation    */
+  size_t volatile rc;       /* SHR_MP: slots claimed, ever          */
+  size_t volatile rs;       /* SHR_MP: slots released, ever         */
+  size_t volatile rb;       /* SHR_MP: bytes released, ever         */
+
+  /* both sides */
+  LINE
+  size_t volatile u;        /* current number of unread bytes       */
+  size_t volatile m;        /* current number of unread messages    */
+  size_t volatile fly;      /* slots in flight, or SLOT_VOID        */
+  unsigned long long volatile wm_t0; /* unread since (watermarks) */
+
+  LINE
+  size_t volatile sgen;     /* stats generation, odd while changing */
+  size_t cid;               /* last client id given out (id_claim)  */
+  struct timeval start;     /* start of the stats period            */
+  struct stat_slot zero;    /* counter totals at start of period    */
+  struct stat_slot rest;    /* counters of closed/unslotted clients */
+  struct stat_slot ss[STAT_SLOTS]; /* per-client counters           */
+
+  LINE
   bw_handle w2r;            /* implements reader blocking           */
   bw_handle r2w;            /* implements writer blocking           */
+
+  __attribute__((aligned(DATA_ALIGN)))
   char d[];                 /* ring data; C99 flexible array member */
 } shr_ctrl;
 
@@ -77,6 +182,27 @@ struct shr {
   struct cache c; /* when ring is opened SHR_BUFFERED */
   size_t n;       /* copy of r->n to utilize w/o lock */
   size_t mm;      /* copy of r->mm to utilize w/o lock */
+  unsigned gflags;/* copy of r->gflags, w/o lock      */
+  int locked;     /* lock domains we hold (SHR_MUTEX) */
+  struct stat_slot *ss; /* our i/o counters in the ring */
+  size_t cid;     /* our client id (see id_claim)     */
+  int fwait;      /* we block on a futex (SHR_FUTEX)  */
+  unsigned spin_max; /* longest spin before blocking, ns */
+  unsigned spin_lim; /* current spin limit, adapted, ns  */
+  size_t wm_m;    /* our read watermark, msgs (or 0)  */
+  size_t wm_b;    /* our read watermark, bytes (or 0) */
+  unsigned long long wm_ns; /* our watermark, delay, ns */
+  int volatile *rwant; /* wakeup request: r->rwait, rwm */
+  int tfd;        /* timerfd for wm_ns, if non-block  */
+  int efd;        /* epoll of wait_fd and tfd         */
+  size_t room_b;  /* SHR_WRROOM: poll for bytes free  */
+  size_t room_m;  /* SHR_WRROOM: and slots free       */
+  size_t pk_first; /* shr_read_peek: claim to release */
+  size_t pk_mc;   /* messages peeked, not released    */
+  size_t pk_nr;   /* bytes peeked, not released       */
+  size_t rv_len;  /* shr_write_reserve: bytes, or 0   */
+  size_t rv_t;    /* its slot; SHR_MP: its sequence   */
+  size_t ps;      /* page size the ring is mapped with */
   union {
     char *buf;    /* ring file mmap'd location        */
     shr_ctrl * r; /* ring file control region         */
@@ -102,16 +228,27 @@ struct shr {
  *
  * lastly, on Linux you can see the active locks in /proc/locks
  *
+ * the lock has two domains: writers lock one (LOCK_W), readers the other
+ * (LOCK_R), as they update separate fields in the ring. a file lock for
+ * a domain is a one-byte range, at offset 0 or 1. LOCK_ALL locks both.
+ * see lock_io for who takes which. the bytes past those are for the
+ * client id locks (see id_claim), so no range here reaches them.
+ *
  * returns
  *  0 on success
  * -1 on error
  */
-static int lock(int fd) {
+#define LOCK_W   1
+#define LOCK_R   2
+#define LOCK_ALL (LOCK_W|LOCK_R)
+static int lock_file(int fd, int dom) {
   int rc = -1, sc;
 
   const struct flock f = {
     .l_type = F_WRLCK,
-    .l_whence = SEEK_SET
+    .l_whence = SEEK_SET,
+    .l_start = (dom == LOCK_R) ? 1 : 0,
+    .l_len = (dom == LOCK_ALL) ? 2 : 1
   };
 
   sc = fcntl(fd, F_SETLKW, &f);
@@ -126,12 +263,14 @@ static int lock(int fd) {
   return rc;
 }
 
-static int unlock(int fd) {
+static int unlock_file(int fd, int dom) {
   int rc = -1, sc;
 
   const struct flock f = {
     .l_type = F_UNLCK,
-    .l_whence = SEEK_SET
+    .l_whence = SEEK_SET,
+    .l_start = (dom == LOCK_R) ? 1 : 0,
+    .l_len = (dom == LOCK_ALL) ? 2 : 1
   };
 
   sc = fcntl(fd, F_SETLK, &f);
@@ -146,6 +285,278 @@ static int unlock(int fd) {
   return rc;
 }
 
+/*
+ * id_claim
+ *
+ * give a newly opened handle its client id, one never given out before,
+ * and lock byte LOCK_IDS + id of the ring file for as long as the handle
+ * is open. the lock is an open file description lock (F_OFD_SETLK) on
+ * the handle's own descriptor, so the kernel drops it when the handle
+ * is closed, or its process dies, however that happens. whether another
+ * handle is still open is then a test for its lock (see alive). unlike
+ * a test on a pid, that holds across pid namespaces, and after the pid
+ * is reused. called under lock
+ *
+ * returns
+ *  0 on success
+ * -1 on error
+ */
+#define LOCK_IDS 2
+static int id_claim(struct shr *s) {
+  int rc = -1, sc;
+
+  s->cid = ++s->r->cid;
+
+  struct flock f = {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = LOCK_IDS + s->cid,
+    .l_len = 1
+  };
+
+  sc = fcntl(s->ring_fd, F_OFD_SETLK, &f);
+  if (sc < 0) {
+    shr_log("fcntl id lock: %s\n", strerror(errno));
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * alive
+ *
+ * tell whether the handle with client id cid is still open, by testing
+ * for its id lock. our own lock never conflicts with us, so our own id
+ * is answered without the test. if the test fails, the client is taken
+ * to be alive, which only ever delays a recovery.
+ *
+ * returns
+ *  1 if the handle is open
+ *  0 if it was closed, or its process died
+ */
+static int alive(struct shr *s, size_t cid) {
+  int sc;
+
+  if (cid == s->cid) return 1;
+
+  struct flock f = {
+    .l_type = F_WRLCK,
+    .l_whence = SEEK_SET,
+    .l_start = LOCK_IDS + cid,
+    .l_len = 1
+  };
+
+  sc = fcntl(s->ring_fd, F_OFD_GETLK, &f);
+  if (sc < 0) {
+    shr_log("fcntl id test: %s\n", strerror(errno));
+    return 1;
+  }
+
+  return (f.l_type == F_UNLCK) ? 0 : 1;
+}
+
+/* get the ring lock. this is the file lock above, unless the ring was
+ * created with SHR_MUTEX. then it is a robust, process-shared mutex in
+ * the control region, one per domain. an uncontended lock or unlock of
+ * the mutex stays in user space; the file lock costs a syscall each way.
+ *
+ * the mutex is robust: if its owner dies holding it, the next locker
+ * gets EOWNERDEAD, which we accept, as the file lock would be released
+ * on exit too. to keep the file lock's "relock/unlock is a no-op"
+ * semantics (see above), we track which mutexes this handle holds.
+ * the writer mutex is always taken before the reader mutex.
+ *
+ * returns
+ *  0 on success
+ * -1 on error
+ */
+static int lock_dom(struct shr *s, int dom) {
+  pthread_mutex_t *m;
+  int rc = -1, sc, d;
+
+  if ((s->gflags & SHR_MUTEX) == 0)
+    return lock_file(s->ring_fd, dom);
+
+  for(d = LOCK_W; d <= LOCK_R; d <<= 1) {
+    if ((dom & d) == 0) continue;
+    if (s->locked & d) continue;
+    m = (d == LOCK_W) ? &s->r->mtx : &s->r->rmtx;
+
+    sc = pthread_mutex_lock(m);
+    if (sc == EOWNERDEAD) {
+      shr_log("ring lock: owner died, recovering\n");
+      sc = pthread_mutex_consistent(m);
+    }
+    if (sc) {
+      shr_log("pthread_mutex_lock: %s\n", strerror(sc));
+      goto done;
+    }
+
+    s->locked |= d;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+static int unlock_dom(struct shr *s, int dom) {
+  pthread_mutex_t *m;
+  int rc = -1, sc, d;
+
+  if ((s->gflags & SHR_MUTEX) == 0)
+    return unlock_file(s->ring_fd, dom);
+
+  for(d = LOCK_R; d >= LOCK_W; d >>= 1) {
+    if ((dom & d) == 0) continue;
+    if ((s->locked & d) == 0) continue;
+    m = (d == LOCK_W) ? &s->r->mtx : &s->r->rmtx;
+
+    sc = pthread_mutex_unlock(m);
+    if (sc) {
+      shr_log("pthread_mutex_unlock: %s\n", strerror(sc));
+      goto done;
+    }
+
+    s->locked &= ~d;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* the whole ring lock, both domains. shr_open, shr_close, shr_stat
+ * and the like take this. so does anything touching the wait handles
+ * (bw_open, bw_close); then either domain alone suffices for bw_wake */
+static int lock(struct shr *s) {
+  return lock_dom(s, LOCK_ALL);
+}
+
+static int unlock(struct shr *s) {
+  return unlock_dom(s, LOCK_ALL);
+}
+
+/* the i/o paths (shr_readv, shr_writev) take the ring lock this
+ * way. a writer takes the writer domain, a reader the reader domain:
+ * the writer owns the write position and the eldest message, the
+ * reader the read position. they share the unread counts (r->u, r->m),
+ * updated atomically, and the slot states (see SLOT_READY).
+ *
+ * in SHR_DROP mode a writer moves the read position, dropping unread
+ * messages, so both sides take the whole lock. in SHR_FARM mode the
+ * readers change nothing in the ring, and don't take the lock; they
+ * validate their reads instead (see release_msgs). in SHR_SPSC mode
+ * neither side takes the lock: the one writer and the one reader each
+ * own their side of the ring (see shr_writev). SHR_MP writers don't
+ * take the lock (see mp_write).
+ */
+static inline int io_dom(struct shr *s) {
+  if (s->gflags & SHR_SPSC) return 0;
+  if (s->gflags & SHR_FARM) return (s->flags & SHR_RDONLY) ? 0 : LOCK_W;
+  if (s->gflags & SHR_DROP) return LOCK_ALL;
+  return (s->flags & SHR_RDONLY) ? LOCK_R : LOCK_W;
+}
+
+static inline int lock_io(struct shr *s) {
+  int dom = io_dom(s);
+  return dom ? lock_dom(s, dom) : 0;
+}
+
+static inline int unlock_io(struct shr *s) {
+  int dom = io_dom(s);
+  return dom ? unlock_dom(s, dom) : 0;
+}
+
+/* unread bytes and messages. in SHR_MP mode these include
+ * reservations whose writers are still copying them in. the
+ * totals may move without the lock; a difference is only taken
+ * between values that held at the same moment */
+static inline size_t mp_diff(size_t volatile *w, size_t volatile *r) {
+  size_t a, b;
+  do {
+    a = __atomic_load_n(w, __ATOMIC_ACQUIRE);
+    b = __atomic_load_n(r, __ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(w, __ATOMIC_ACQUIRE) != a);
+  return a - b;
+}
+
+/* SHR_MP: the bytes reserved, ever, by the first ws slots reserved.
+ * each slot records the bytes reserved before it; a slot is reused
+ * only at reservation ws + mm, so the last one reserved still does */
+static inline size_t mp_wb(shr_ctrl *r, size_t ws) {
+  struct msg *mv, *m;
+
+  if (ws == 0) return 0;
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+  m = &mv[ (ws - 1) % r->mm ];
+  return m->pos + m->len;
+}
+
+/* SHR_MP: slots and bytes reserved, ever, as they were at one moment.
+ * the slot read by mp_wb may be reused as it's read, if r->ws moves */
+static inline void mp_reserved(shr_ctrl *r, size_t *ws, size_t *wb) {
+  do {
+    *ws = __atomic_load_n(&r->ws, __ATOMIC_ACQUIRE);
+    *wb = mp_wb(r, *ws);
+  } while (__atomic_load_n(&r->ws, __ATOMIC_ACQUIRE) != *ws);
+}
+
+static inline size_t unread_bytes(shr_ctrl *r) {
+  size_t ws, wb, rb;
+
+  if ((r->gflags & SHR_MP) == 0) return r->u;
+  do {
+    mp_reserved(r, &ws, &wb);
+    rb = __atomic_load_n(&r->rb, __ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&r->ws, __ATOMIC_ACQUIRE) != ws);
+  return wb - rb;
+}
+
+static inline size_t unread_msgs(shr_ctrl *r) {
+  return (r->gflags & SHR_MP) ? mp_diff(&r->ws, &r->rs) : r->m;
+}
+
+/*
+ * want_wake
+ *
+ * a writer wakes readers only if one asked for a wakeup (r->rwait);
+ * likewise a reader wakes writers only if one waits for space
+ * (r->wwait). a reader asks before it blocks, or, if non-blocking,
+ * when its fd is cleared; a writer asks before it blocks. so a busy
+ * peer costs no wakeup syscalls. to not lose a wakeup, the waiting
+ * side raises its flag, then looks at the ring again; the other side
+ * updates the ring (seq_cst), then takes the flag. at least one of
+ * them sees the other's update. the flag stands for all the waiters
+ * on that side: whoever takes it wakes them all, and any still
+ * waiting raise it again. a flag left by a process that died costs
+ * one needless wakeup.
+ *
+ * the flag is set here, and cleared by take_wake, or by no_wake
+ * when it can only be our own (the SHR_SPSC reader or writer).
+ */
+static inline void want_wake(int volatile *flag) {
+  __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void no_wake(int volatile *flag) {
+  if (*flag) __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+}
+
+/* take the wakeup request, if any. take it before waking;
+ * a peer that re-arms after this keeps its request */
+static inline int take_wake(int volatile *flag) {
+  if (__atomic_load_n(flag, __ATOMIC_SEQ_CST) == 0) return 0;
+  return __atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST);
+}
+
 /*
  * shr_sync
  *
@@ -184,6 +595,84 @@ static int shr_sync(shr *s) {
   return rc;
 }
 
+/*
+ * init_mutex
+ *
+ * initialize the ring lock for a SHR_MUTEX ring. it lives
+ * in the mapped file, so it has to be process-shared. it
+ * is robust so a process dying while holding it does not
+ * leave the ring locked forever (see lock).
+ *
+ * called with ring file under lock, during shr_init
+ *
+ * returns
+ *  0 on success
+ * -1 on error
+ */
+static int init_mutex(shr_ctrl *r) {
+  pthread_mutexattr_t ma;
+  int rc = -1, sc;
+
+  sc = pthread_mutexattr_init(&ma);
+  if (sc) {
+    shr_log("pthread_mutexattr_init: %s\n", strerror(sc));
+    return -1;
+  }
+
+  sc = pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+  if (sc) {
+    shr_log("pthread_mutexattr_setpshared: %s\n", strerror(sc));
+    goto done;
+  }
+
+  sc = pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+  if (sc) {
+    shr_log("pthread_mutexattr_setrobust: %s\n", strerror(sc));
+    goto done;
+  }
+
+  sc = pthread_mutex_init(&r->mtx, &ma);
+  if (sc == 0) sc = pthread_mutex_init(&r->rmtx, &ma);
+  if (sc) {
+    shr_log("pthread_mutex_init: %s\n", strerror(sc));
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  pthread_mutexattr_destroy(&ma);
+  return rc;
+}
+
+/*
+ * huge_page_size
+ *
+ * the huge page size for ring file fd: on hugetlbfs, its block size;
+ * elsewhere, the size of a transparent huge page (THP). if hugetlb is
+ * not NULL, it's set to whether fd is on hugetlbfs.
+ */
+#define THP_SIZE_FILE "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size"
+#define THP_SIZE_DEF (2 * 1024 * 1024)
+static size_t huge_page_size(int fd, int *hugetlb) {
+  unsigned long sz = 0;
+  struct statfs sf;
+  FILE *f;
+
+  if (hugetlb) *hugetlb = 0;
+  if ((fstatfs(fd, &sf) == 0) && (sf.f_type == HUGETLBFS_MAGIC)) {
+    if (hugetlb) *hugetlb = 1;
+    return sf.f_bsize;
+  }
+
+  f = fopen(THP_SIZE_FILE, "r");
+  if (f) {
+    if (fscanf(f, "%lu", &sz) != 1) sz = 0;
+    fclose(f);
+  }
+  return sz ? sz : THP_SIZE_DEF;
+}
+
 /*
  * shr_init creates a ring file
  *
@@ -193,6 +682,12 @@ static int shr_sync(shr *s) {
  *    SHR_APPDATA_1    - store caller buffer in ring (buf,len args)
  *    SHR_MAXMSGS_2    - ring holds given number of msgs (size_t arg)
  *    SHR_KEEPEXIST    - if ring exists already, leave as-is
+ *    SHR_MUTEX        - lock ring with robust mutex, not file lock
+ *    SHR_SPSC         - one writer, one reader; i/o without lock
+ *    SHR_MP           - many writers reserve space without lock
+ *    SHR_FUTEX        - blocking handles wait on futexes, not sockets
+ *    SHR_MIRROR       - data mapped twice in a row; messages never wrap
+ *    SHR_HUGEPAGE     - size and map the ring in whole huge pages
  *
  * returns 
  *   0 on success
@@ -200,18 +695,49 @@ static int shr_sync(shr *s) {
  *
  */
 int shr_init(char *file, size_t data_sz, unsigned flags, ...) {
-  size_t appsize=0, sz=0, mv_bytes, max_msgs=0, pad, m;
+  size_t appsize=0, sz=0, mv_bytes, max_msgs=0, pad, m, pg, hp=0, slack;
   int rc = -1, fd = -1, exists, sc;
   char *appdata=NULL, *buf=NULL;
 
   va_list ap;
   va_start(ap, flags);
 
-  if ((flags >= SHR_OPEN_FENCE) || (data_sz == 0)) {
+  if ((flags & ~INIT_FLAGS) || (data_sz == 0)) {
     shr_log("shr_init: invalid flags\n");
     goto done;
   }
 
+  /* a SHR_SPSC reader owns the read position; nobody else
+   * may move it, as SHR_DROP does. SHR_FARM implies DROP */
+  if ((flags & SHR_SPSC) && (flags & (SHR_DROP|SHR_FARM))) {
+    shr_log("shr_init: SHR_SPSC is incompatible with SHR_DROP\n");
+    goto done;
+  }
+
+  /* SHR_MP writers don't see each other's slots until committed,
+   * so none of them can drop old data; nor is there one writer */
+  if ((flags & SHR_MP) && (flags & (SHR_DROP|SHR_FARM|SHR_SPSC))) {
+    shr_log("shr_init: SHR_MP is incompatible with SHR_DROP/SHR_SPSC\n");
+    goto done;
+  }
+
+  /* the mirror is mapped at a page offset in the file, so the data
+   * is placed at one, and its size rounded up to a whole page. that
+   * offset is never a huge page one, which hugetlbfs would require */
+  if (flags & SHR_MIRROR) {
+    pg = sysconf(_SC_PAGESIZE);
+    if (flags & SHR_HUGEPAGE) {
+      shr_log("shr_init: SHR_MIRROR is incompatible with SHR_HUGEPAGE\n");
+      goto done;
+    }
+    if (sizeof(shr_ctrl) % pg) {
+      shr_log("shr_init: SHR_MIRROR needs pages of %u bytes or less\n",
+        DATA_ALIGN);
+      goto done;
+    }
+    data_sz = ((data_sz + pg - 1) / pg) * pg;
+  }
+
   if (flags & SHR_APPDATA_1) {
     appdata = va_arg(ap, char*);
     appsize = va_arg(ap, size_t);
@@ -249,16 +775,30 @@ int shr_init(char *file, size_t data_sz, unsigned flags, ...) {
   m = data_sz % sizeof(void*);
   pad = m ? (sizeof(void*) - m) : 0;
   assert(pad < sizeof(void*));
+
+  /* in SHR_MIRROR mode the padding is a hole in the file, as long
+   * as the data, where shr_open maps the data again. it stays sparse */
+  if (flags & SHR_MIRROR) pad = data_sz;
+
+  /* in SHR_HUGEPAGE mode the file is sized in whole huge pages. the
+   * slack goes to the ring data, so none of the last page is wasted */
+  if (flags & SHR_HUGEPAGE) {
+    hp = huge_page_size(fd, NULL);
+    sz = sizeof(shr_ctrl) + data_sz + pad + mv_bytes + appsize;
+    slack = (hp - sz % hp) % hp;
+    data_sz += slack - (slack % sizeof(void*));
+  }
   sz = sizeof(shr_ctrl) + data_sz + pad;
   assert((sz % sizeof(void*)) == 0);
 
-  if (lock(fd) < 0) /* close() below releases lock */
+  if (lock_file(fd, LOCK_ALL) < 0) /* close() below releases lock */
     goto done;
 
   /* set the ring file size. ftruncate is unimplemented
    * on hugetlbfs, so we permit EINVAL; on that fs, the
    * mmap itself suffices to set ring's length in pages */
   sz = sizeof(shr_ctrl) + data_sz + pad + mv_bytes + appsize;
+  if (hp) sz = ((sz + hp - 1) / hp) * hp;
   sc = ftruncate(fd, sz);
   if ((sc < 0) && (errno != EINVAL)) {
     shr_log("ftruncate %s: %s\n", file, strerror(errno));
@@ -275,19 +815,28 @@ int shr_init(char *file, size_t data_sz, unsigned flags, ...) {
   shr_ctrl *r = (shr_ctrl *)buf; 
   memset(r, 0, sizeof(*r));
   memcpy(r->magic, magic, sizeof(magic));
+  r->ctrl_len = sizeof(shr_ctrl);
   r->mm = max_msgs;
   r->pad_len = pad;
   r->mv_len = mv_bytes;
   r->app_len = appsize;
   r->n = data_sz;
+  r->hp = hp;
   r->gflags = 0;
   if (flags & SHR_SYNC)      r->gflags |=  SHR_SYNC;
   if (flags & SHR_DROP)      r->gflags |=  SHR_DROP;
   if (flags & SHR_FARM)      r->gflags |= (SHR_FARM | SHR_DROP);
   if (flags & SHR_MLOCK)     r->gflags |=  SHR_MLOCK;
+  if (flags & SHR_MUTEX)     r->gflags |=  SHR_MUTEX;
+  if (flags & SHR_SPSC)      r->gflags |=  SHR_SPSC;
+  if (flags & SHR_MP)        r->gflags |=  SHR_MP;
+  if (flags & SHR_FUTEX)     r->gflags |=  SHR_FUTEX;
+  if (flags & SHR_MIRROR)    r->gflags |=  SHR_MIRROR;
+  if (flags & SHR_HUGEPAGE)  r->gflags |=  SHR_HUGEPAGE;
   if (flags & SHR_APPDATA) {
     memcpy(r->d + r->n + r->pad_len + r->mv_len, appdata, appsize);
   }
+  if ((flags & SHR_MUTEX) && (init_mutex(r) < 0)) goto done;
 
   rc = 0;
 
@@ -300,6 +849,155 @@ int shr_init(char *file, size_t data_sz, unsigned flags, ...) {
 }
 
 
+/*
+ * stat_add
+ *
+ * count i/o in our stats slot. we're the only one counting in it,
+ * but shr_stat reads it without the lock, so the store is atomic.
+ * the shared slot r->rest takes an atomic add.
+ */
+static inline void stat_add(struct shr *s, size_t *c, size_t n) {
+  if (s->ss != &s->r->rest) __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+  else __atomic_add_fetch(c, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * slot_sum
+ *
+ * add the counters of stats slot ss into t
+ */
+static void slot_sum(struct stat_slot *t, struct stat_slot *ss) {
+  t->bw += __atomic_load_n(&ss->bw, __ATOMIC_RELAXED);
+  t->br += __atomic_load_n(&ss->br, __ATOMIC_RELAXED);
+  t->mw += __atomic_load_n(&ss->mw, __ATOMIC_RELAXED);
+  t->mr += __atomic_load_n(&ss->mr, __ATOMIC_RELAXED);
+  t->md += __atomic_load_n(&ss->md, __ATOMIC_RELAXED);
+  t->bd += __atomic_load_n(&ss->bd, __ATOMIC_RELAXED);
+}
+
+/*
+ * stat_begin/stat_end
+ *
+ * bracket a change to the stats slots other than counting (a slot
+ * folded into r->rest, or a reset). r->sgen is odd meanwhile.
+ * called under lock, which keeps out other such changes.
+ */
+static void stat_begin(shr_ctrl *r) {
+  __atomic_store_n(&r->sgen, r->sgen + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stat_end(shr_ctrl *r) {
+  __atomic_store_n(&r->sgen, r->sgen + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * stat_totals
+ *
+ * add up the counters of all the clients, ever, into t. a total that
+ * overlaps a change bracketed by stat_begin and stat_end is taken
+ * again, so every client is counted just once. if z is non-NULL, it
+ * gets the totals at the start of the stats period, and start gets
+ * its start time, consistent with t.
+ */
+static void stat_totals(shr_ctrl *r, struct stat_slot *t,
+                        struct stat_slot *z, struct timeval *start) {
+  size_t g, k;
+
+  while (1) {
+    g = __atomic_load_n(&r->sgen, __ATOMIC_ACQUIRE);
+    if (g & 1) { sched_yield(); continue; }
+
+    t->bw = t->br = t->mw = t->mr = t->md = t->bd = 0;
+    slot_sum(t, &r->rest);
+    for(k = 0; k < STAT_SLOTS; k++) slot_sum(t, &r->ss[k]);
+    if (z) *z = r->zero;          /* struct copy */
+    if (z) *start = r->start;     /* struct copy */
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->sgen, __ATOMIC_RELAXED) == g) break;
+  }
+}
+
+/*
+ * wm_sync
+ *
+ * set the ring's lowest reader watermarks (r->wm_m, wm_b, wm_ns) from
+ * those the readers keep in their stats slots; 0 where none has one.
+ * called under lock, when a reader's watermarks change or its slot
+ * is freed. see wm_due.
+ */
+static void wm_sync(shr_ctrl *r) {
+  unsigned long long ns = 0;
+  size_t k, m = 0, b = 0;
+  struct stat_slot *ss;
+
+  for(k = 0; k < STAT_SLOTS; k++) {
+    ss = &r->ss[k];
+    if (ss->cid == 0) continue;
+    if (ss->wm_m && ((m == 0) || (ss->wm_m < m))) m = ss->wm_m;
+    if (ss->wm_b && ((b == 0) || (ss->wm_b < b))) b = ss->wm_b;
+    if (ss->wm_ns && ((ns == 0) || (ss->wm_ns < ns))) ns = ss->wm_ns;
+  }
+
+  r->wm_m = m;
+  r->wm_b = b;
+  r->wm_ns = ns;
+}
+
+/* move the counts of a stats slot into r->rest, freeing the slot */
+static void slot_fold(shr_ctrl *r, struct stat_slot *ss) {
+  stat_begin(r);
+  slot_sum(&r->rest, ss);
+  ss->bw = ss->br = ss->mw = ss->mr = ss->md = ss->bd = 0;
+  ss->cid = 0;
+  ss->pid = 0;
+  stat_end(r);
+
+  if (ss->wm_m || ss->wm_b || ss->wm_ns) {
+    ss->wm_m = ss->wm_b = ss->wm_ns = 0;
+    wm_sync(r);
+  }
+}
+
+/*
+ * stat_claim
+ *
+ * claim a stats slot for a newly opened handle. a free slot is taken
+ * first. failing that, the slot of a client that died without closing
+ * the ring (see alive) is folded into r->rest and taken. failing that,
+ * the handle counts in r->rest. called under lock.
+ */
+static void stat_claim(struct shr *s) {
+  shr_ctrl *r = s->r;
+  size_t k;
+
+  s->ss = &r->rest;
+
+  for(k = 0; k < STAT_SLOTS; k++) {
+    if (r->ss[k].cid == 0) break;
+  }
+
+  if (k == STAT_SLOTS) {
+    for(k = 0; k < STAT_SLOTS; k++) {
+      if (alive(s, r->ss[k].cid) == 0) break;
+    }
+    if (k == STAT_SLOTS) return;
+    slot_fold(r, &r->ss[k]);
+  }
+
+  r->ss[k].flags = s->flags & (SHR_RDONLY|SHR_WRONLY);
+  r->ss[k].pid = getpid();
+  __atomic_store_n(&r->ss[k].cid, s->cid, __ATOMIC_RELEASE);
+  s->ss = &r->ss[k];
+}
+
+/* give up the stats slot, keeping its counts in r->rest. under lock */
+static void stat_release(struct shr *s) {
+  if (s->ss && (s->ss != &s->r->rest)) slot_fold(s->r, s->ss);
+  s->ss = NULL;
+}
+
 /* 
  * shr_stat
  *
@@ -307,24 +1005,41 @@ int shr_init(char *file, size_t data_sz, unsigned flags, ...) {
  * struct timeval it points to is written into the internal stats
  * structure, counters are zeroed, beginning a new stats period.
  *
+ * without reset, this takes no lock and makes no system call, so
+ * a monitor can poll it freely without slowing the ring's i/o.
+ * the unread bytes (bu) and messages (mu) are two separate samples:
+ * i/o updates the two counts one after the other, so a write or read
+ * in progress can show in one and not yet the other (say, mu == 0
+ * with bu > 0). they agree whenever the ring is quiescent.
+ *
  * returns 
  *  0 on success (and fills in *stat)
  * -1 on failure
  *
  */
 int shr_stat(shr *s, struct shr_stat *stat, struct timeval *reset) {
+  struct stat_slot t, z;
+  shr_ctrl *r = s->r;
   int rc = -1;
 
-  if (lock(s->ring_fd) < 0) goto done;
+  memset(stat, 0, sizeof(*stat));
+
+  if (reset && (lock(s) < 0)) goto done;
 
-  /* copy stats */
-  *stat = s->r->stat;
+  /* the clients' counters, less those at the start of the period */
+  stat_totals(r, &t, &z, &stat->start);
+  stat->bw = t.bw - z.bw;
+  stat->br = t.br - z.br;
+  stat->mw = t.mw - z.mw;
+  stat->mr = t.mr - z.mr;
+  stat->md = t.md - z.md;
+  stat->bd = t.bd - z.bd;
 
-  /* ring state */
-  stat->bn = s->r->n;
-  stat->bu = s->r->u;
-  stat->mu = s->r->m;
-  stat->mm = s->r->mm;
+  /* ring state. bu and mu are separate samples, see above */
+  stat->bn = r->n;
+  stat->bu = unread_bytes(r);
+  stat->mu = unread_msgs(r);
+  stat->mm = r->mm;
 
   /* cache state */
   stat->cn = s->c.sz;
@@ -332,22 +1047,65 @@ int shr_stat(shr *s, struct shr_stat *stat, struct timeval *reset) {
   stat->cb = s->c.n;
 
   /* ring attributes */
-  stat->flags = s->r->gflags;
+  stat->flags = r->gflags;
+  stat->ps = s->ps;
 
   if (reset) {
-    memset(&s->r->stat, 0, sizeof(s->r->stat));
-    s->r->stat.start = *reset; /* struct copy */
+    stat_begin(r);
+    r->zero = t; /* struct copy */
+    r->start = *reset; /* struct copy */
+    stat_end(r);
+    if (shr_sync(s) < 0) goto done;
   }
 
-  if (shr_sync(s) < 0) goto done;
-
   rc = 0;
 
  done:
-  unlock(s->ring_fd);
+  if (reset) unlock(s);
   return rc;
 }
 
+/*
+ * shr_stat_clients
+ *
+ * retrieve the i/o counters of each client that has the ring open,
+ * other than the caller, into the array c, of *nc structures. *nc is
+ * set to the number filled in. a client's counters are from when it
+ * opened the ring; a reset (see shr_stat) has no bearing on them.
+ * clients beyond the ring's table of stats slots are not listed, nor
+ * are those that died without closing the ring, whose slots are kept
+ * until needed (see alive). like shr_stat, this takes no lock.
+ *
+ * returns 
+ *  0 on success
+ * -1 on error
+ */
+int shr_stat_clients(shr *s, struct shr_client *c, size_t *nc) {
+  struct stat_slot *ss;
+  shr_ctrl *r = s->r;
+  size_t k, n = 0, cid;
+
+  for(k = 0; (k < STAT_SLOTS) && (n < *nc); k++) {
+    ss = &r->ss[k];
+    if (ss == s->ss) continue;
+    cid = __atomic_load_n(&ss->cid, __ATOMIC_ACQUIRE);
+    if (cid == 0) continue;
+    if (alive(s, cid) == 0) continue;
+    c[n].pid = ss->pid;
+    c[n].flags = ss->flags;
+    c[n].bw = __atomic_load_n(&ss->bw, __ATOMIC_RELAXED);
+    c[n].br = __atomic_load_n(&ss->br, __ATOMIC_RELAXED);
+    c[n].mw = __atomic_load_n(&ss->mw, __ATOMIC_RELAXED);
+    c[n].mr = __atomic_load_n(&ss->mr, __ATOMIC_RELAXED);
+    c[n].md = __atomic_load_n(&ss->md, __ATOMIC_RELAXED);
+    c[n].bd = __atomic_load_n(&ss->bd, __ATOMIC_RELAXED);
+    n++;
+  }
+
+  *nc = n;
+  return 0;
+}
+
 /*
  * shr_farm_stat
  *
@@ -391,6 +1149,11 @@ static int validate_ring(struct shr *s) {
   if (s->s.st_size < (off_t)MIN_RING_SZ)       { rc = -2; goto done; }
   if (memcmp(s->r->magic,magic,sizeof(magic))) { rc = -3; goto done; }
 
+  /* the magic changes with the layout. as a backstop, in case it
+   * was left as is, the creator's sizes must match ours too */
+  if (r->ctrl_len != sizeof(shr_ctrl))         { rc = -9; goto done; }
+  if (r->mv_len != r->mm * sizeof(struct msg)) { rc = -10; goto done; }
+
   exp_sz = sizeof(shr_ctrl) + r->n + r->pad_len + r->mv_len + r->app_len;
   sz = s->s.st_size;
 
@@ -398,6 +1161,8 @@ static int validate_ring(struct shr *s) {
   if (r->u >  r->n) {rc = -5; goto done; } /* used > size */
   if (r->i >= r->n) {rc = -6; goto done; } /* input position >= size */
   if (r->r >= r->mm){rc = -7; goto done; } /* output slot# >= #slots */
+  if ((r->gflags & SHR_MIRROR) && (r->pad_len < r->n))
+                    {rc = -8; goto done; } /* no room for the mirror */
 
   rc = 0;
 
@@ -406,35 +1171,122 @@ static int validate_ring(struct shr *s) {
 }
 
 /*
- * shr_get_selectable_fd
- *
- * returns a file descriptor that can be used with select/poll/epoll 
+ * page_size
  *
- * succeeds only if the ring was opened with SHR_RDONLY|SHR_NONBLOCK
- * the caller must be non-blocking because spurious wakeups can occur 
- * e.g. two writes + two wakeups -> one coalesced read + extra wakeup
- * thus, an shr_read arising from a spurious wakeup needs to not block
- * 
- * readers only: writers can't poll externally for space availability
+ * the page size the ring is mapped with: on hugetlbfs, its huge page
+ * size; in SHR_HUGEPAGE mode elsewhere, the THP size it asked for;
+ * otherwise the system page size.
  */
-int shr_get_selectable_fd(shr *s) {
-  if ((s->flags & SHR_RDONLY) &&
-      (s->flags & SHR_NONBLOCK)) return s->wait_fd;
-  return -1;
+static size_t page_size(shr *s) {
+  int hugetlb;
+  size_t hp;
+
+  hp = huge_page_size(s->ring_fd, &hugetlb);
+  if (hugetlb) return hp;
+  if (s->r->hp) return s->r->hp;
+  return sysconf(_SC_PAGESIZE);
 }
 
-/* helper to open the bw library handles during shr_open 
-*
- * called with the ring under lock 
+/*
+ * map_huge
+ *
+ * in SHR_HUGEPAGE mode, map the ring again at an address aligned to
+ * its huge page size, so each huge page of the file can back a huge
+ * page of the mapping, and drop the first mapping. off hugetlbfs, ask
+ * for transparent huge pages; that's advisory (THP may be disabled,
+ * or not enabled for the file system, as by the tmpfs huge= option).
+ *
+ */
+static int map_huge(struct shr *s) {
+  size_t hp = s->r->hp, len = s->s.st_size, head;
+  char *va, *a, *m;
+  int hugetlb;
+
+  /* reserve room for an aligned mapping, keep the aligned part */
+  va = mmap(0, len + hp, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+            -1, 0);
+  if (va == MAP_FAILED) {
+    shr_log("mmap: %s\n", strerror(errno));
+    return -1;
+  }
+  head = (hp - (uintptr_t)va % hp) % hp;
+  a = va + head;
+  if (head) munmap(va, head);
+  munmap(a + len, hp - head);
+
+  m = mmap(a, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, s->ring_fd, 0);
+  if (m == MAP_FAILED) {
+    shr_log("mmap huge: %s\n", strerror(errno));
+    munmap(a, len);
+    return -1;
+  }
+  munmap(s->buf, len);
+  s->buf = a;
+
+  huge_page_size(s->ring_fd, &hugetlb);
+  if (hugetlb == 0) madvise(a, len, MADV_HUGEPAGE);
+  return 0;
+}
+
+/*
+ * map_mirror
+ *
+ * in SHR_MIRROR mode, map the ring data a second time, right after
+ * itself, over the hole shr_init left for it. a message that runs
+ * past the end of the data then carries on, seamlessly, into its
+ * start. munmap of the ring unmaps the mirror along with it.
+ *
+ */
+static int map_mirror(struct shr *s) {
+  shr_ctrl *r = s->r;
+  char *m;
+
+  m = mmap(r->d + r->n, r->n, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED,
+           s->ring_fd, sizeof(shr_ctrl));
+  if (m == MAP_FAILED) {
+    shr_log("mmap mirror: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * shr_get_selectable_fd
+ *
+ * returns a file descriptor that can be used with select/poll/epoll 
+ *
+ * succeeds only if the ring was opened with SHR_RDONLY|SHR_NONBLOCK
+ * the caller must be non-blocking because spurious wakeups can occur 
+ * e.g. two writes + two wakeups -> one coalesced read + extra wakeup
+ * thus, an shr_read arising from a spurious wakeup needs to not block
+ * 
+ * a reader given SHR_RDMAX_DELAY gets an epoll descriptor that also
+ * covers its delay timer; so call this after shr_ctl
+ *
+ * a non-blocking writer can poll for free space, once it has told
+ * shr_ctl how much it wants (SHR_WRROOM). its descriptor is readable
+ * while that much is free. spurious wakeups can occur here too.
+ */
+int shr_get_selectable_fd(shr *s) {
+  if ((s->flags & SHR_NONBLOCK) == 0) return -1;
+  if (s->flags & SHR_RDONLY) return (s->efd != -1) ? s->efd : s->wait_fd;
+  if (s->room_m) return s->wait_fd;
+  return -1;
+}
+
+/* helper to open the bw library handles during shr_open 
+*
+ * called with the ring under lock 
  *
  * regarding need_r2w: 
  *   it's always ok for writer to open the r2w handle.
  *   but, we prefer not to open it, unless we need it.
  *   if open, a reader is obligated to send wakeups
  *   when they free space in the ring, to wake writers 
- *   blocked in shr_write. but, in cases where the ring
- *   is in SHR_DROP mode, or the writer is non blocking,
- *   writes succeed or fail without needing to block. 
+ *   blocked in shr_write. but, in cases where the
+ *   writer is non blocking, writes succeed or fail
+ *   without needing to block. (a SHR_DROP writer makes
+ *   its own room, but may block on a peeked message.)
  *   for these writers we leave the r2w handle closed. 
  *   this is just for performance. if a non blocking 
  *   writer later calls shr_flush(s,1) to do a blocking
@@ -442,14 +1294,29 @@ int shr_get_selectable_fd(shr *s) {
  *
  */
 static int open_blockwake(struct shr *s, int flags) {
-  int rc = -1, sc, need_r2w;
+  int rc = -1, sc, need_r2w, ready;
+
+  /* in a SHR_FUTEX ring, a blocking handle waits on a futex */
+  if ((s->gflags & SHR_FUTEX) && ((flags & SHR_NONBLOCK) == 0)) {
+    s->fwait = 1;
+  }
 
-  if (flags & SHR_RDONLY) {
+  if ((flags & SHR_RDONLY) && s->fwait) {
+    s->r2w = bw_open(BW_WAKE, &s->r->r2w);
+    if (s->r2w == NULL) goto done;
+  }
+  else if (flags & SHR_RDONLY) {
     s->w2r = bw_open(BW_WAIT, &s->r->w2r, &s->wait_fd);
     s->r2w = bw_open(BW_WAKE, &s->r->r2w);
     if ((s->w2r == NULL) || (s->r2w == NULL)) goto done;
-    /* set initial readability of fd */
-    sc = bw_force(s->w2r, s->r->u ? 1 : 0);
+    /* set initial readability of fd. writers only
+     * wake us on request; so request it if unready */
+    ready = unread_bytes(s->r) ? 1 : 0;
+    if (ready == 0) {
+      want_wake(&s->r->rwait);
+      ready = unread_bytes(s->r) ? 1 : 0;
+    }
+    sc = bw_force(s->w2r, ready);
     if (sc < 0) goto done;
   }
   
@@ -458,7 +1325,7 @@ static int open_blockwake(struct shr *s, int flags) {
     if (s->w2r == NULL) goto done;
     /* does writer need free-space wakeups? */
     need_r2w =  (((s->flags & SHR_NONBLOCK) == 0) &&
-                 ((s->r->gflags & SHR_DROP) == 0)) ?  1 : 0;
+                 (s->fwait == 0)) ?  1 : 0;
     if (need_r2w) {
       s->r2w = bw_open(BW_WAIT, &s->r->r2w, &s->wait_fd);
       if (s->r2w == NULL) goto done;
@@ -473,12 +1340,62 @@ static int open_blockwake(struct shr *s, int flags) {
   return rc;
 }
 
+/*
+ * claim_role
+ *
+ * a SHR_SPSC ring admits one writer and one reader at a time. record
+ * our client id as the ring's writer or reader, unless a handle still
+ * open has that role already (see alive). the role of a handle that
+ * was never closed, its process having died, is taken over. a writer
+ * publishes nothing until its copy is done, so there is nothing of a
+ * dead one's to clean up; nor of a dead reader's, which moves the read
+ * position only after its copy.
+ *
+ * called with the ring under lock
+ *
+ * returns
+ *  0 on success
+ * -1 if the role is taken
+ */
+static int claim_role(struct shr *s) {
+  size_t *owner;
+
+  if ((s->gflags & SHR_SPSC) == 0) return 0;
+
+  owner = (s->flags & SHR_RDONLY) ? &s->r->rcid : &s->r->wcid;
+  if (*owner && alive(s, *owner)) {
+    shr_log("shr_open: SHR_SPSC ring has a %s already\n",
+      (s->flags & SHR_RDONLY) ? "reader" : "writer");
+    return -1;
+  }
+
+  *owner = s->cid;
+  return 0;
+}
+
+/* give up the SHR_SPSC role taken in claim_role.
+ * called with the ring under lock */
+static void release_role(struct shr *s) {
+  size_t *owner;
+
+  if ((s->gflags & SHR_SPSC) == 0) return;
+  if (s->flags & SHR_MONITOR) return;
+
+  owner = (s->flags & SHR_RDONLY) ? &s->r->rcid : &s->r->wcid;
+  assert(*owner == s->cid);
+  *owner = 0;
+}
+
 static int validate_flags(int flags) {
 
   if (((flags & SHR_RDONLY) ^ (flags & SHR_WRONLY)) == 0)
     return -1; 
 
-  if (flags & (SHR_OPEN_FENCE-1))
+  if (flags & INIT_FLAGS)
+    return -1;
+
+  if ((flags & SHR_MONITOR) &&
+      ((flags & SHR_WRONLY) || (flags & (SHR_NONBLOCK|SHR_BUFFERED))))
     return -1;
 
   return 0;
@@ -540,6 +1457,9 @@ static int init_cache(struct shr *s, int flags) {
  *    SHR_BUFFERED    - buffer writes
  *    SHR_NONBLOCK    - reads/writes fail immediately
  *                      when data/space unavailable
+ *    SHR_MONITOR     - with SHR_RDONLY: only look at the
+ *                      ring (shr_stat, shr_appdata); not
+ *                      a reader, nor a SHR_SPSC reader
  *
  * returns:
  *  struct shr * on success (opaque to caller)
@@ -547,7 +1467,7 @@ static int init_cache(struct shr *s, int flags) {
  *
  */
 struct shr *shr_open(const char *file, unsigned flags, ...) {
-  int rc = -1, sc, prot;
+  int rc = -1, sc, prot, claimed = 0;
   struct shr *s = NULL;
 
   va_list ap;
@@ -565,6 +1485,8 @@ struct shr *shr_open(const char *file, unsigned flags, ...) {
   }
   s->ring_fd = -1;
   s->wait_fd = -1;
+  s->tfd = -1;
+  s->efd = -1;
   s->flags = flags;
 
   s->ring_fd = open(file, O_RDWR);
@@ -588,16 +1510,25 @@ struct shr *shr_open(const char *file, unsigned flags, ...) {
     goto done;
   }
 
-  if (lock(s->ring_fd) < 0) goto done;
+  /* the file lock orders us after shr_init. once the
+   * ring is validated, we take the ring lock proper */
+  if (lock_file(s->ring_fd, LOCK_ALL) < 0) goto done;
   sc = validate_ring(s);
   if (sc < 0) {
     shr_log("validate_ring failed: %s (%d)\n", file, sc);
     goto done;
   }
 
+  s->gflags = s->r->gflags;
+  if ((s->gflags & SHR_HUGEPAGE) && (map_huge(s) < 0)) goto done;
+  if ((s->gflags & SHR_MIRROR) && (map_mirror(s) < 0)) goto done;
+  s->ps = page_size(s);
+  if (lock(s) < 0) goto done;
+
   s->q = s->r->q;
   s->n = s->r->n;
   s->mm = s->r->mm;
+  s->rwant = &s->r->rwait;
 
   /* prefault and lock pages in memory if requested */
   sc = (s->r->gflags & SHR_MLOCK) ? mlock(s->buf, s->s.st_size) : 0;
@@ -606,13 +1537,26 @@ struct shr *shr_open(const char *file, unsigned flags, ...) {
     goto done;
   }
 
+  if (id_claim(s) < 0) goto done;
+
+  /* a monitor takes no role, stats slot or wakeups */
+  if (flags & SHR_MONITOR) {
+    rc = 0;
+    goto done;
+  }
+
+  if (claim_role(s) < 0) goto done;
+  claimed = 1;
+  stat_claim(s);
+
   if (open_blockwake(s, flags) < 0) goto done;
   if (init_cache(s, flags) < 0) goto done;
   if (shr_sync(s) < 0) goto done;
   rc = 0;
 
  done:
-  if (s && (s->ring_fd != -1)) unlock(s->ring_fd);
+  if (s && rc && claimed) { release_role(s); stat_release(s); }
+  if (s && (s->ring_fd != -1)) { unlock(s); unlock_file(s->ring_fd, LOCK_ALL); }
   if (s && rc) {
     if (s->ring_fd != -1) close(s->ring_fd);
     if (s->buf) munmap(s->buf, s->s.st_size);
@@ -623,15 +1567,70 @@ struct shr *shr_open(const char *file, unsigned flags, ...) {
   return s;
 }
 
+/*
+ * seek_gap
+ *
+ * for drop_unread and reclaim_eldest. the messages from slot p on lie
+ * back to back in the ring, so the distance from ring offset base, up
+ * to the start of each in turn, only grows. binary search messages lo
+ * to hi-1 for the first at which the distance is at least want bytes.
+ * returns its index, counting from p, or hi if none is that far.
+ */
+static size_t seek_gap(shr_ctrl *r, size_t p, size_t lo, size_t hi,
+                       size_t base, size_t want) {
+  size_t mid, d;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    d = (mv[ (p + mid) % r->mm ].pos + r->n - base) % r->n;
+    if (d >= want) hi = mid;
+    else lo = mid + 1;
+  }
+  return lo;
+}
+
+/*
+ * void_slot
+ *
+ * a writer that dies copying a message in leaves its slot SLOT_WRITING,
+ * and readers stop there. if the slot's owner is gone, mark it SLOT_VOID.
+ * readers skip a void slot, as unread data that was dropped, and writers
+ * reclaim it once it's behind the readers (see reclaim_eldest).
+ *
+ * called by readers and writers alike, under either lock (or none, by
+ * farm readers); the live owner alone moves a slot out of SLOT_WRITING
+ *
+ * returns 1 if the slot is void
+ */
+static int void_slot(struct shr *s, struct msg *m) {
+  size_t c = __atomic_load_n(&m->c, __ATOMIC_ACQUIRE);
+
+  if ((c == SLOT_WRITING) && (alive(s, m->o) == 0))
+    __atomic_compare_exchange_n(&m->c, &c, SLOT_VOID, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+  return (__atomic_load_n(&m->c, __ATOMIC_ACQUIRE) == SLOT_VOID) ? 1 : 0;
+}
+
 /* 
  * drop unread messages from the ring (SHR_DROP mode).
  * so that 'need' is satisfied from the available free
  * space plus the dropped space.
  *
+ * a message still being copied in (SLOT_WRITING) can't
+ * be dropped; the drop stops short of it, unless its
+ * writer died (see void_slot).
+ *
  * called under lock 
  *
+ * returns
+ *  1 if the space is available
+ *  0 if an in-flight message is in the way
  */
-static inline void drop_unread(struct shr *s, size_t need, size_t niov) {
+static inline int drop_unread(struct shr *s, size_t need, size_t niov) {
   size_t ab, am, i, p, z;
   shr_ctrl *r = s->r;
   struct msg *mv;
@@ -651,8 +1650,20 @@ static inline void drop_unread(struct shr *s, size_t need, size_t niov) {
   z = 0;
   p = r->r;
 
+  /* with no message in flight, none is in the way.
+   * find the number to drop by binary search */
+  if (__atomic_load_n(&r->fly, __ATOMIC_SEQ_CST) == 0) {
+    i = (niov > am) ? (niov - am) : 0;
+    if (r->m && (need > ab))
+      i = seek_gap(r, p, i, r->m, mv[ p ].pos, need - ab);
+    z = (i < r->m) ? ((mv[ (p + i) % r->mm ].pos + r->n - mv[ p ].pos) % r->n)
+                   : r->u;
+    p = (p + i) % r->mm;
+  }
+
   /* drop messages to free slots and space */
   while ((niov > am+i) || (need > ab+z)) {
+    if ((mv[ p ].c == SLOT_WRITING) && (void_slot(s, &mv[ p ]) == 0)) break;
     z += mv[ p ].len;
     i++;
     p++;
@@ -662,11 +1673,89 @@ static inline void drop_unread(struct shr *s, size_t need, size_t niov) {
   r->r = p;
   r->u -= z;
   r->m -= i;
-  r->stat.bd += z;
-  r->stat.md += i;
+  stat_add(s, &s->ss->bd, z);
+  stat_add(s, &s->ss->md, i);
+
+  return ((r->n - r->u >= need) && (r->mm - r->m >= niov)) ? 1 : 0;
+}
+
+/*
+ * reclaim_eldest
+ *
+ * advance eldest position if our write will overwrite
+ * its data or occupy its slot in mv. the unread data
+ * is already known to leave room; this reclaims read
+ * messages. one that's being copied out by a reader
+ * (SLOT_READING) or in by a writer can't be reclaimed,
+ * unless that reader died; not even in SHR_DROP mode,
+ * as a peeked message stays valid until its release.
+ * void slots (see void_slot) are reclaimed like read
+ * messages.
+ *
+ * called under the writer lock (or in SHR_SPSC mode, by its writer)
+ *
+ * returns
+ *  1 if the space is available
+ *  0 if an in-flight message is in the way
+ */
+static int reclaim_eldest(struct shr *s, size_t len, size_t niov) {
+  size_t a, e, mp, i, l, c;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+  int room = 1;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  /* copy volatile r->* to involatile
+   * locals here for speed; we hold lock */
+  a = 0;
+  e = r->e;
+  mp = r->mp;
+  i = r->i;
+
+  /* with no message in flight, none is in the way.
+   * find the number to reclaim by binary search */
+  if (mp && (__atomic_load_n(&r->fly, __ATOMIC_SEQ_CST) == 0)) {
+    a = (niov > s->mm - mp) ? (niov - (s->mm - mp)) : 0;
+    a = seek_gap(r, e, a, mp, i, len);
+    e = (e + a) % s->mm;
+    mp -= a;
+  }
+
+  while (mp) {
+    if (i > mv[ e ].pos)
+      l = (r->n - i) + mv[ e ].pos;
+    else
+      l = mv[ e ].pos - i;
+
+    if ((len <= l) && (s->mm - mp >= niov))
+      break;
+
+    c = __atomic_load_n(&mv[ e ].c, __ATOMIC_ACQUIRE);
+    if ((c == SLOT_VOID) ||
+        ((c == SLOT_READING) && (alive(s, mv[ e ].o) == 0))) {
+      __atomic_store_n(&mv[ e ].c, SLOT_READY, __ATOMIC_RELEASE);
+      __atomic_sub_fetch(&r->fly, 1, __ATOMIC_SEQ_CST);
+      c = SLOT_READY;
+    }
+    if (c != SLOT_READY) {
+      room = 0;
+      break;
+    }
+
+    e++;
+    if (e == s->mm) e = 0;
+    a++;
+    mp--;
+  }
+  /* farm readers look at these without the lock. the
+   * eldest moves up before its slot or space is reused */
+  r->e = e;
+  __atomic_store_n(&r->mp, mp, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->q, r->q + a, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 
-  assert(r->n - r->u >= need);
-  assert(r->mm - r->m >= niov);
+  return room;
 }
 
 /*
@@ -709,186 +1798,1688 @@ ssize_t shr_read(struct shr *s, char *buf, size_t len) {
 
 
 /*
- * next_msg_info
- *
- * without advancing afterward, return the buffer
- * position and length of the next available message.
- * actually, return two buffers and two lengths. why?
- * because the message may wrap around the end of ring 
- *
- * called with ring under lock
+ * has_space
  *
- * returns
- *    0  (no message ready) 
- *    1  message is ready
+ * test if the ring has room for a write of len bytes in niov messages.
+ * the reader may be freeing space concurrently in SHR_SPSC mode.
  */
-static inline int next_msg_info(shr *s, char **m1, size_t *l1,
-                                        char **m2, size_t *l2 ) {
-  int msg_ready, msg_wraps;
-  size_t slot, len, pos;
-  shr_ctrl *r = s->r;
-  struct msg *mv;
+static inline int has_space(shr_ctrl *r, size_t len, size_t niov) {
+  size_t u = __atomic_load_n(&r->u, __ATOMIC_ACQUIRE);
+  size_t m = __atomic_load_n(&r->m, __ATOMIC_ACQUIRE);
+  return ((r->n - u >= len) && (r->mm - m >= niov)) ? 1 : 0;
+}
 
-  mv = (struct msg*)(r->d + r->n + r->pad_len);
+/*
+ * mp_has_space
+ *
+ * test if a SHR_MP ring has room for len bytes in niov messages, past
+ * the reservations ws, wb. readers may be releasing space concurrently.
+ * reservations that have since moved on, as a hint for waits and
+ * wakeups may have, can be behind what was released; that passes.
+ */
+static inline int mp_has_space(shr_ctrl *r, size_t ws, size_t wb,
+                               size_t len, size_t niov) {
+  size_t rb = __atomic_load_n(&r->rb, __ATOMIC_SEQ_CST);
+  size_t rs = __atomic_load_n(&r->rs, __ATOMIC_SEQ_CST);
 
-  /* if farm reader's "next read" sequence number has
-   * passed out of ring, advance to eldest available */
-  if ((r->gflags & SHR_FARM) && (s->q < r->q)) {
-    s->md += (r->q - s->q); 
-    s->q = r->q;
-  }
+  if ((rs > ws) || (rb > wb)) return 1;
+  return ((r->n - (wb - rb) >= len) && (r->mm - (ws - rs) >= niov)) ? 1 : 0;
+}
 
-  if (r->gflags & SHR_FARM)
-    msg_ready = (s->q < r->q + r->mp) ? 1 : 0;
-  else
-    msg_ready = r->m ? 1 : 0;
+/*
+ * want_room
+ *
+ * a writer about to wait for space records how much it needs (r->wn_b,
+ * r->wn_m), so readers wake it once that much is free (room_met), not
+ * each time a message is read. with several writers waiting, the least
+ * need is kept. the waker clears it to 0, which means any space will
+ * do; a woken writer still short records its need again. so the need
+ * recorded never exceeds that of a waiting writer, and none is left
+ * waiting on space that is there.
+ */
+static inline void lower_need(size_t volatile *need, size_t v) {
+  size_t cur = __atomic_load_n(need, __ATOMIC_SEQ_CST);
+  while (((cur == 0) || (v < cur)) &&
+         !__atomic_compare_exchange_n(need, &cur, v, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
 
-  if (msg_ready == 0) return 0;
+static inline void want_room(shr_ctrl *r, size_t len, size_t niov) {
+  lower_need(&r->wn_b, len);
+  lower_need(&r->wn_m, niov);
+}
 
-  /* what slot in mv points to the next message? */
-  slot = (r->gflags & SHR_FARM) ?
-         (s->q % r->mm) :
-         r->r;
+static inline int room_met(shr_ctrl *r) {
+  size_t b = __atomic_load_n(&r->wn_b, __ATOMIC_SEQ_CST);
+  size_t m = __atomic_load_n(&r->wn_m, __ATOMIC_SEQ_CST);
+  size_t ws, wb;
 
-  pos = mv[ slot ].pos;
-  len = mv[ slot ].len;
-  msg_wraps = (pos + len > r->n) ? 1 : 0;
+  if ((b == 0) && (m == 0)) return 1;
+  if (r->gflags & SHR_MP) {
+    mp_reserved(r, &ws, &wb);
+    return mp_has_space(r, ws, wb, b, m);
+  }
+  return has_space(r, b, m);
+}
 
-  *m1 = &r->d[ pos ];
-  *l1 = msg_wraps ? (r->n - pos) : len;
-  *m2 = msg_wraps ? r->d : NULL;
-  *l2 = msg_wraps ? (len - *l1) : 0;
-  return 1;
+static inline unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /*
- * read multiple messages from ring
+ * wake/wait_ul
  *
- * also see shr_read
+ * wake the readers (W2R) or the writers (R2W) after updating the ring,
+ * or wait for that wakeup. without SHR_FUTEX, these are bw_wake and
+ * bw_wait_ul on the datagram sockets of the bw library: one send per
+ * waiter registered, and epoll_wait plus a receive in the waiter.
  *
- * the function copies ring data into buf, and populates the struct iovec
- * array so each one points to a message in buf.  the caller provides the
- * uninitialized array of iov and this function fills them in. niov is an
- * IN/OUT parameter; on input it's the number of structures in iov, and on
- * output it's how many this function filled in.
+ * a SHR_FUTEX ring has a wake generation for each direction (wait_gen).
+ * a blocking waiter takes it before it looks at the ring, and then waits
+ * with FUTEX_WAIT only if it hasn't changed; the waker bumps it after
+ * updating the ring, and wakes its sleepers with one FUTEX_WAKE. a
+ * handle that needs a selectable fd (non-blocking readers, or a handle
+ * given SHR_POLLFD) still waits on bw, so the waker wakes bw too; with
+ * no such handles, that's no system call. wake needs the bw handle under
+ * lock (either domain), as bw_wake does.
  *
- * returns:
- *   > 0 (number of bytes read from the ring)
- *   0   (no data in ring, in non-blocking mode)
- *  -1   (error)
- *  -2   (buffer can't hold message)
- *  -3   (caller descriptor became ready while blocked; see bw_ctl BW_POLLFD)
+ * wake wakes up to n waiters (WAKE_ALL for all): futex sleepers first,
+ * then bw waiters, which take turns (bw_wake_n). *more is set if some
+ * waiters may be left unwoken. wait_ul waits at most tmo ns, if non-zero;
+ * a timeout is a successful return, like a wakeup.
  *
+ * returns 0 on success (wake: the number woken)
+ *        -1 on error
+ *        -3 (wait_ul) see bw_ctl BW_POLLFD
  */
-ssize_t
-shr_readv(shr *s, char *buf, size_t len, struct iovec *iov, size_t *niov) {
-  int sc, rc = -1, msg_ready;
-  size_t mc = 0, l1, l2;
-  shr_ctrl *r = s->r;
-  char *m1, *m2;
-  ssize_t nr=0;
+#define W2R 0
+#define R2W 1
+#define WAKE_ALL INT_MAX
 
-  assert(s->flags & SHR_RDONLY);
-
-  if (len == 0) goto done;
-  if (*niov == 0) goto done;
-  if (len > SSIZE_MAX) len = SSIZE_MAX;
+static inline int volatile *wake_word(shr_ctrl *r, int dir) {
+  return (dir == W2R) ? &r->wgen : &r->rgen;
+}
 
-  /* test or await data availability */
-  while (1) {
+static inline int wait_gen(struct shr *s, int dir) {
+  if (s->fwait == 0) return 0;
+  return __atomic_load_n(wake_word(s->r, dir), __ATOMIC_SEQ_CST);
+}
 
-    sc = lock(s->ring_fd);
-    if (sc < 0) goto done;
+static int wake(struct shr *s, int dir, int n, int *more) {
+  int volatile *word;
+  int woken = 0, sc, left;
+  long fc;
 
-    msg_ready = next_msg_info(s, &m1, &l1, &m2, &l2);
-    if (msg_ready) break;
+  *more = 0;
 
-    if (s->flags & SHR_NONBLOCK) {
-      bw_force(s->w2r, 0);
-      rc = 0;
-      goto done;
+  if (s->gflags & SHR_FUTEX) {
+    word = wake_word(s->r, dir);
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    fc = syscall(SYS_futex, word, FUTEX_WAKE, n, NULL, NULL, 0);
+    if (fc < 0) {
+      shr_log("futex: %s\n", strerror(errno));
+      return -1;
     }
-
-    /* blocking wait. awake/retry */
-    unlock(s->ring_fd);
-    sc = bw_wait_ul(s->w2r);
-    if (sc) {
-      rc = sc; /* see bw_ctl BW_POLLFD */
-      goto done;
+    woken = (int)fc;
+    if (woken == n) {
+      *more = 1;
+      return woken;
     }
   }
 
-  /* reached when data is available */
-  while (msg_ready) {
-    if (*niov == 0)  break; /* caller iov exhausted */
-    if (l1+l2 > len) break; /* caller buf exhausted */
-    iov[mc].iov_base = buf;
-    iov[mc].iov_len = l1+l2;
-    memcpy(buf, m1, l1);
-    if (l2)
-      memcpy(buf + l1, m2, l2);
-    buf += (l1+l2);
-    len -= (l1+l2);
-    nr +=  (l1+l2);
-    (*niov)--;
-    mc++;
+  sc = bw_wake_n((dir == W2R) ? s->w2r : s->r2w, n - woken, &left);
+  if (sc < 0) return -1;
+  *more = left ? 1 : 0;
+  return woken + sc;
+}
 
-    /* advance read position */
-    if (r->gflags & SHR_FARM) s->q++;
-    else {
-      r->r = (r->r + 1) % r->mm;
-      r->u -= (l1+l2);
-      r->m--;
-    }
+static int wait_ul(struct shr *s, int dir, int gen, unsigned long long tmo) {
+  struct timespec ts;
+  int ms;
+  long sc;
 
-    msg_ready = next_msg_info(s, &m1, &l1, &m2, &l2);
+  if (s->fwait == 0) {
+    ms = tmo ? (int)MIN((tmo + 999999) / 1000000, INT_MAX) : -1;
+    sc = bw_timedwait_ul((dir == W2R) ? s->w2r : s->r2w, ms);
+    return (sc == -2) ? 0 : (int)sc;
   }
 
-  r->stat.br += nr;
-  r->stat.mr += mc;
-  if (nr > 0) bw_wake(s->r2w);
-  rc = (mc > 0) ? 0 : -2;
-  bw_force(s->w2r, msg_ready);
-  if (shr_sync(s) < 0) goto done;
+  ts.tv_sec = tmo / 1000000000ULL;
+  ts.tv_nsec = tmo % 1000000000ULL;
+  sc = syscall(SYS_futex, wake_word(s->r, dir), FUTEX_WAIT, gen,
+               tmo ? &ts : NULL, NULL, 0);
+  if ((sc < 0) && (errno != EAGAIN) && (errno != ETIMEDOUT)) {
+    shr_log("futex: %s\n", strerror(errno));
+    return -1;
+  }
 
- done:
-  unlock(s->ring_fd);
-  *niov = mc;
-  return (rc == 0) ? (ssize_t)nr : rc;
+  return 0;
+}
+
+/*
+ * watermarks
+ *
+ * a reader can ask to be woken only once a batch of data is unread
+ * (SHR_RDMIN_MSGS, SHR_RDMIN_BYTES), or once unread data has waited a
+ * while (SHR_RDMAX_DELAY). such a reader asks for its wakeups in r->rwm,
+ * rather than r->rwait. a writer can't tell one waiting reader from
+ * another, so it wakes them when the lowest watermarks of all readers
+ * (r->wm_m, wm_b, wm_ns; see wm_sync) are reached; one whose own are
+ * not (wm_ready) waits again. the wait of unread data counts from
+ * r->wm_t0, stamped by whoever first finds unread data, and cleared by
+ * a reader that empties the ring. a writer that stamps it wakes the
+ * readers too, so they can time their wait for the delay to run out.
+ */
+static int wm_due(shr_ctrl *r) {
+  unsigned long long t0, now, ns = r->wm_ns;
+
+  if (unread_msgs(r) == 0) return 0;
+  if (r->wm_m && (unread_msgs(r) >= r->wm_m)) return 1;
+  if (r->wm_b && (unread_bytes(r) >= r->wm_b)) return 1;
+  if (ns == 0) return 0;
+
+  now = now_ns();
+  t0 = __atomic_load_n(&r->wm_t0, __ATOMIC_SEQ_CST);
+  if (t0 == 0) return __atomic_compare_exchange_n(&r->wm_t0, &t0, now, 0,
+                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return (now - t0 >= ns) ? 1 : 0;
+}
+
+/* a writer, after updating the ring: is a watermark reader due a wakeup */
+static inline int wm_wanted(shr_ctrl *r) {
+  if (__atomic_load_n(&r->rwm, __ATOMIC_SEQ_CST) == 0) return 0;
+  return wm_due(r);
 }
 
+/* a reader with unread data: has it reached its own watermarks? if
+ * not, *tmo gets the time until its delay runs out (0: no delay) */
+static int wm_ready(struct shr *s, unsigned long long *tmo) {
+  unsigned long long t0, now;
+  shr_ctrl *r = s->r;
+
+  *tmo = 0;
+  if (s->rwant == &r->rwait) return 1;
+  if (s->wm_m && (unread_msgs(r) >= s->wm_m)) return 1;
+  if (s->wm_b && (unread_bytes(r) >= s->wm_b)) return 1;
+  if (s->wm_ns == 0) return 0;
+
+  now = now_ns();
+  t0 = __atomic_load_n(&r->wm_t0, __ATOMIC_SEQ_CST);
+  if ((t0 == 0) && __atomic_compare_exchange_n(&r->wm_t0, &t0, now, 0,
+                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) t0 = now;
+  if (now - t0 >= s->wm_ns) return 1;
+  *tmo = t0 + s->wm_ns - now;
+  return 0;
+}
 
 /*
- * write sequential io buffers into ring
+ * wake_wanted
  *
- * if there is sufficient space in the ring - copy the whole iovec in.
- * if there is insufficient free space in the ring- wait for space, or
- * return 0 immediately in non-blocking mode. only writes all or nothing.
- * each iovec element becomes one message.
+ * take the peers' wakeup request (see want_wake), if any, and wake up
+ * to n of them. farm readers each read every message, so a writer wakes
+ * them all; other readers compete for the messages, so it wakes as many
+ * as it wrote messages, rather than a herd that mostly finds them gone.
+ * if others may still wait, the request is raised again for them.
+ * readers waiting on a watermark (r->rwm) are woken too if wm is set;
+ * see wm_wanted. writers are only woken once the space they wait for
+ * is free; see want_room.
  *
- * returns:
- *   > 0 (number of bytes copied into ring, always the full iovec)
- *   0   (insufficient space in ring, in non-blocking mode)
- *  -1   (error, such as the iovec exceeds the total ring capacity)
- *  -2   (not used)
- *  -3   (caller descriptor became ready while blocked; see bw_ctl BW_POLLFD)
+ * called with the ring under lock (either domain)
  *
+ * returns 0 on success
+ *        -1 on error
  */
-ssize_t shr_writev(shr *s, struct iovec *iov, size_t niov) {
-  size_t bsz, len=0, i, l1, l2, p, l, e, a, mp;
-  int rc = -1, sc, msg_wraps;
+static int wake_wanted(struct shr *s, int volatile *flag, int dir, size_t n,
+                       int wm) {
+  int lim, more, rw;
+
+  if ((dir == R2W) && (room_met(s->r) == 0)) return 0;
+  rw = take_wake(flag);
+  if (wm) wm = take_wake(&s->r->rwm);
+  if ((rw == 0) && (wm == 0)) return 0;
+  if (dir == R2W) {
+    __atomic_store_n(&s->r->wn_b, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s->r->wn_m, 0, __ATOMIC_SEQ_CST);
+  }
+
+  lim = ((dir == R2W) || (s->gflags & (SHR_FARM|SHR_SPSC)) ||
+         (n >= WAKE_ALL)) ? WAKE_ALL : (int)n;
+  if (wake(s, dir, lim, &more) < 0) return -1;
+  if (more && rw) want_wake(flag);
+  if (more && wm) want_wake(&s->r->rwm);
+  return 0;
+}
+
+/*
+ * wake_if_wanted
+ *
+ * the SHR_SPSC (and SHR_MP writer) counterpart of wake_wanted. called
+ * after updating the ring, without the ring lock. wake itself needs the
+ * lock, since a peer's bw_open or bw_close changes the wait handle under
+ * it, so this takes the lock, but only if the peer wants the wakeup.
+ *
+ * returns 0 on success
+ *        -1 on error
+ */
+static int wake_if_wanted(struct shr *s, int volatile *flag, int dir,
+                          size_t n) {
+  int rc = -1, sc, wm;
+
+  wm = (dir == W2R) ? wm_wanted(s->r) : 0;
+  if ((__atomic_load_n(flag, __ATOMIC_SEQ_CST) == 0) && (wm == 0)) return 0;
+  if ((dir == R2W) && (room_met(s->r) == 0)) return 0;
+
+  if (lock(s) < 0) goto done;
+  sc = wake_wanted(s, flag, dir, n, wm);
+  if (sc < 0) goto done;
+
+  rc = 0;
+
+ done:
+  unlock(s);
+  return rc;
+}
+
+/*
+ * farm_msg_info
+ *
+ * next_msg_info for a farm reader, which looks at the ring without
+ * the lock. the messages in the ring are those numbered r->q to
+ * r->q + r->mp - 1. a writer that reclaims the eldest moves r->q up
+ * before it reuses its slot (see reclaim_eldest). so if r->q is the
+ * same before the look at r->mp and the slot as after it, the slot
+ * held message s->q + k throughout; otherwise, look again.
+ */
+static int farm_msg_info(shr *s, size_t k, size_t *pos, size_t *len) {
+  size_t slot, q, mp;
   shr_ctrl *r = s->r;
   struct msg *mv;
-  ssize_t nr;
-  char *buf;
+  int msg_ready;
 
-  assert(s->flags & SHR_WRONLY);
   mv = (struct msg*)(r->d + r->n + r->pad_len);
 
-  for(i=0; i < niov; i++) {
-    len += iov[i].iov_len;
-    if (len == 0) goto done;
-    if (len > SSIZE_MAX) goto done;
+  do {
+    q = __atomic_load_n(&r->q, __ATOMIC_ACQUIRE);
+    mp = __atomic_load_n(&r->mp, __ATOMIC_ACQUIRE);
+
+    /* if our "next read" sequence number has passed
+     * out of ring, advance to eldest available */
+    if ((k == 0) && (s->q < q)) {
+      s->md += (q - s->q);
+      s->q = q;
+    }
+
+    slot = (s->q + k) % r->mm;
+    msg_ready = ((s->q + k >= q) && (s->q + k < q + mp) &&
+                 (__atomic_load_n(&mv[ slot ].c, __ATOMIC_ACQUIRE) ==
+                  SLOT_READY)) ? 1 : 0;
+    if (msg_ready) {
+      *pos = mv[ slot ].pos;
+      *len = mv[ slot ].len;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&r->q, __ATOMIC_ACQUIRE) != q);
+
+  return msg_ready;
+}
+
+/*
+ * next_msg_info
+ *
+ * without advancing afterward, return the ring offset and length of
+ * the k'th message past the read position, if it's available. k > 0
+ * looks ahead, for a read of several messages. the messages that are
+ * available from the read position on lie contiguously in the ring.
+ *
+ * called under the reader lock (or without it, by SHR_SPSC and farm readers)
+ *
+ * a message being copied into the ring (SLOT_WRITING) is not ready,
+ * nor is any after it. in SHR_MP mode, writers commit their slots out
+ * of order; only the committed ones at the read position are ready.
+ * a farm reader looks without the lock (see farm_msg_info). a writer
+ * may reclaim the messages it found while it copies them out; the
+ * reader finds that out after its copy (see release_msgs).
+ *
+ * returns
+ *    0  (no message ready) 
+ *    1  message is ready
+ */
+static inline int next_msg_info(shr *s, size_t k, size_t *pos, size_t *len) {
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+  int msg_ready;
+  size_t slot;
+
+  if (r->gflags & SHR_FARM) return farm_msg_info(s, k, pos, len);
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  /* what slot in mv points to the message? */
+  slot = (r->r + k) % r->mm;
+
+  if (r->gflags & SHR_MP)
+    msg_ready = (__atomic_load_n(&mv[ slot ].c, __ATOMIC_ACQUIRE) ==
+                 r->rc + k + 1) ? 1 : 0;
+  else
+    msg_ready = ((k < __atomic_load_n(&r->m, __ATOMIC_ACQUIRE)) &&
+                 (__atomic_load_n(&mv[ slot ].c, __ATOMIC_ACQUIRE) ==
+                  SLOT_READY)) ? 1 : 0;
+
+  if (msg_ready == 0) return 0;
+
+  *pos = (r->gflags & SHR_MP) ? (mv[ slot ].pos % r->n) : mv[ slot ].pos;
+  *len = mv[ slot ].len;
+  return 1;
+}
+
+/*
+ * head_len
+ *
+ * the part of a message of len bytes at pos that lies before the
+ * end of the ring data; the rest wraps around to its start. in
+ * SHR_MIRROR mode, the mirror follows the data, so that's all of it.
+ */
+static inline size_t head_len(shr_ctrl *r, size_t pos, size_t len) {
+  if (r->gflags & SHR_MIRROR) return len;
+  return MIN(len, r->n - pos);
+}
+
+/*
+ * batch
+ *
+ * the messages of one write or read: an iovec per message (shr_writev,
+ * shr_readv), or one buffer holding the messages back to back and a
+ * 32-bit length per message (shr_write_packed, shr_read_packed), or
+ * for writes, an iovec of segments per message (shr_writemsg). a
+ * batch read from the ring is always laid out back to back in buf.
+ */
+struct batch {
+  struct iovec *iov;        /* a buffer per message, or NULL        */
+  struct shr_msg *msgs;     /* or, segments per message, or NULL    */
+  char *buf;                /* or, the messages back to back        */
+  uint32_t *lens;           /* and their lengths                    */
+};
+
+static inline size_t msg_len(struct shr_msg *m) {
+  size_t k, len = 0;
+  for(k=0; k < m->iovcnt; k++) len += m->iov[k].iov_len;
+  return len;
+}
+
+static inline size_t batch_len(struct batch *b, size_t k) {
+  if (b->iov) return b->iov[k].iov_len;
+  if (b->msgs) return msg_len(&b->msgs[k]);
+  return b->lens[k];
+}
+
+/*
+ * span_in
+ *
+ * copy len bytes into the ring at offset pos. consecutive messages
+ * lie back to back in the ring, so a run of them goes in one memcpy
+ * (or two, if it wraps around the end of the ring).
+ */
+static void span_in(shr_ctrl *r, size_t pos, char *buf, size_t len) {
+  size_t l1 = head_len(r, pos, len);
+  memcpy(r->d + pos, buf, l1);
+  if (l1 < len) memcpy(r->d, buf + l1, len - l1);
+}
+
+/*
+ * span_out
+ *
+ * the counterpart to span_in, for readers
+ */
+static void span_out(shr_ctrl *r, size_t pos, char *buf, size_t len) {
+  size_t l1 = head_len(r, pos, len);
+  memcpy(buf, r->d + pos, l1);
+  if (l1 < len) memcpy(buf + l1, r->d, len - l1);
+}
+
+/*
+ * run_len
+ *
+ * count the buffers from iov[0] on, up to mc of them, that lie back
+ * to back in memory; put their total length in *len. such a run goes
+ * into the ring in one span_in. the SHR_BUFFERED cache is laid out
+ * that way, as are batches carved from one buffer.
+ */
+static inline size_t run_len(struct iovec *iov, size_t mc, size_t *len) {
+  char *end = (char*)iov[0].iov_base + iov[0].iov_len;
+  size_t j;
+
+  *len = iov[0].iov_len;
+  for(j=1; (j < mc) && (iov[j].iov_base == end); j++) {
+    *len += iov[j].iov_len;
+    end += iov[j].iov_len;
+  }
+  return j;
+}
+
+/*
+ * copy_iov_in
+ *
+ * copy the buffers of iov into the ring, back to back, starting from
+ * ring offset pos. returns the ring offset after them.
+ */
+static size_t copy_iov_in(shr_ctrl *r, size_t pos, struct iovec *iov,
+                          size_t cnt) {
+  size_t k, j, len;
+
+  for(k=0; k < cnt; k += j) {
+    j = run_len(iov + k, cnt - k, &len);
+    span_in(r, pos, iov[k].iov_base, len);
+    pos = (pos + len) % r->n;
+  }
+  return pos;
+}
+
+/*
+ * copy_in
+ *
+ * copy the mc messages of batch b, len bytes in all, into the ring
+ * starting from ring offset pos. a message may wrap around the end
+ * of the ring. the segments of a gathered message go in back to back.
+ */
+static void copy_in(shr_ctrl *r, size_t pos, struct batch *b, size_t mc,
+                    size_t len) {
+  size_t k;
+
+  if (b->iov) {
+    copy_iov_in(r, pos, b->iov, mc);
+    return;
+  }
+
+  if (b->msgs) {
+    for(k=0; k < mc; k++)
+      pos = copy_iov_in(r, pos, b->msgs[k].iov, b->msgs[k].iovcnt);
+    return;
+  }
+
+  span_in(r, pos, b->buf, len);
+}
+
+/*
+ * spin_wait
+ *
+ * in blocking mode, a reader that finds the ring empty or a writer that
+ * finds it full can spin a while before blocking (see SHR_SPIN), since
+ * the blocking wait costs system calls on both sides. the spin looks at
+ * the ring without the lock, with pause and exponential backoff, until
+ * ready(s, len, niov) or it runs out of time. the caller then looks
+ * again under the lock.
+ *
+ * the time limit adapts: doubled (up to spin_max) when spinning works,
+ * halved (down to spin_max/16) when it doesn't. so a handle whose peer
+ * is usually slow wastes little cpu, and one whose peer is quick keeps
+ * spinning.
+ *
+ * returns 1 if the spin saw the ring become ready, 0 otherwise
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+#define SPIN_PAUSE_MAX 64
+
+static int spin_wait(shr *s, int (*ready)(shr *, size_t, size_t),
+                     size_t len, size_t niov) {
+  unsigned long long end;
+  unsigned k, pauses = 1;
+  int ok = 0;
+
+  end = now_ns() + s->spin_lim;
+  while (1) {
+    if (ready(s, len, niov)) { ok = 1; break; }
+    if (now_ns() >= end) break;
+    for(k = 0; k < pauses; k++) cpu_relax();
+    if (pauses < SPIN_PAUSE_MAX) pauses *= 2;
+  }
+
+  if (ok) s->spin_lim = MIN(s->spin_max, s->spin_lim * 2);
+  else    s->spin_lim = MAX(s->spin_max / 16, s->spin_lim / 2);
+  if (s->spin_lim == 0) s->spin_lim = 1;
+  return ok;
+}
+
+/*
+ * claim_msgs
+ *
+ * take the mc messages (nr bytes) at the read position for this reader,
+ * which copies them out after releasing the lock. on a regular ring the
+ * read position moves past them, and they're marked SLOT_READING so no
+ * writer reclaims them for new data meanwhile. a farm reader just moves
+ * its own position; a writer may overwrite the messages as it copies,
+ * which release_msgs detects. in SHR_SPSC mode the one reader has
+ * nothing to claim; it moves the read position in release_msgs.
+ *
+ * called under the reader lock (or without it, by SHR_SPSC and farm readers)
+ *
+ * returns the sequence number of the first message (farm) or its slot
+ */
+static size_t claim_msgs(shr *s, size_t mc, size_t nr) {
+  shr_ctrl *r = s->r;
+  size_t k, first;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  if (r->gflags & SHR_FARM) {
+    first = s->q;
+    s->q += mc;
+    return first;
+  }
+
+  first = r->r;
+  if (r->gflags & SHR_SPSC) return first;
+
+  r->r = (r->r + mc) % r->mm;
+  if (r->gflags & SHR_MP) {
+    for(k=0; k < mc; k++) mv[ (first + k) % r->mm ].o = s->cid;
+    r->rc += mc;
+    return first;
+  }
+
+  /* writers hold the other lock domain. they see the
+   * slots counted and marked before they see the space freed */
+  __atomic_add_fetch(&r->fly, mc, __ATOMIC_SEQ_CST);
+  for(k=0; k < mc; k++) {
+    mv[ (first + k) % r->mm ].o = s->cid;
+    __atomic_store_n(&mv[ (first + k) % r->mm ].c, SLOT_READING,
+                     __ATOMIC_RELEASE);
+  }
+  __atomic_sub_fetch(&r->u, nr, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&r->m, mc, __ATOMIC_SEQ_CST);
+  return first;
+}
+
+/*
+ * mp_free_slot, mp_free_prefix
+ *
+ * in SHR_MP mode, readers may release slots out of order. the space
+ * freed to writers is the released prefix. a released slot has no
+ * owner, so that a writer can claim it (see mp_claim).
+ *
+ * called under the reader lock
+ */
+static inline void mp_free_slot(struct msg *m) {
+  __atomic_store_n(&m->o, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&m->c, 0, __ATOMIC_RELEASE);
+}
+
+static void mp_free_prefix(shr_ctrl *r) {
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+  while ((r->rs < r->rc) && (mv[ r->rs % r->mm ].c == 0)) {
+    __atomic_add_fetch(&r->rb, mv[ r->rs % r->mm ].len, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&r->rs, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/*
+ * lose_prefix
+ *
+ * for release_msgs: the first lost of the mc messages read into batch
+ * b (*nr bytes, back to back in b->buf) were overwritten as they were
+ * copied out. drop them from the batch, moving the rest to the front
+ * of b->buf, and reduce *nr.
+ */
+static void lose_prefix(struct batch *b, size_t mc, size_t lost,
+                        size_t *nr) {
+  size_t k, lb;
+  char *buf;
+
+  for(lb = 0, k = 0; k < lost; k++) lb += batch_len(b, k);
+  buf = b->buf;
+  memmove(buf, buf + lb, *nr - lb);
+  *nr -= lb;
+  for(k = 0; k < mc - lost; k++) {
+    if (b->lens) {
+      b->lens[k] = b->lens[k + lost];
+      continue;
+    }
+    b->iov[k].iov_base = buf;
+    b->iov[k].iov_len = b->iov[k + lost].iov_len;
+    buf += b->iov[k].iov_len;
+  }
+}
+
+/*
+ * release_msgs
+ *
+ * after the copy, give back the messages taken by claim_msgs. their
+ * space becomes reclaimable by writers. a farm reader instead checks
+ * that no writer has reserved their space since it claimed them, and
+ * discards the ones overwritten, reducing *nr. in SHR_SPSC mode, the
+ * read position moves, freeing the space, now (never before the copy
+ * is done).
+ *
+ * called under the reader lock (or without it, by SHR_SPSC and farm readers)
+ *
+ * returns the number of messages the reader keeps
+ */
+static size_t release_msgs(shr *s, size_t first, size_t mc, size_t *nr,
+                           struct batch *b) {
+  size_t k, lost, q;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  if (r->gflags & SHR_FARM) {
+    /* our copy happened before this look at r->q */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    q = __atomic_load_n(&r->q, __ATOMIC_ACQUIRE);
+    if (q <= first) return mc;
+    lost = MIN(mc, q - first);
+    lose_prefix(b, mc, lost, nr);
+    s->md += lost;
+    return mc - lost;
+  }
+
+  if (r->gflags & SHR_SPSC) {
+    r->r = (r->r + mc) % r->mm;
+    __atomic_sub_fetch(&r->u, *nr, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&r->m, mc, __ATOMIC_SEQ_CST);
+    return mc;
+  }
+
+  if (r->gflags & SHR_MP) {
+    for(k=0; k < mc; k++) mp_free_slot(&mv[ (first + k) % r->mm ]);
+    mp_free_prefix(r);
+    return mc;
+  }
+
+  for(k=0; k < mc; k++)
+    __atomic_store_n(&mv[ (first + k) % r->mm ].c, SLOT_READY, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&r->fly, mc, __ATOMIC_SEQ_CST);
+  return mc;
+}
+
+/*
+ * mp_skip_void
+ *
+ * skip_void for SHR_MP rings. a slot reserved by a writer that died
+ * before committing it is voided: committed with MP_VOID set. void
+ * slots at the read position are claimed and released at once. and
+ * slots claimed by a reader that died copying them out are released,
+ * waking writers waiting for the space.
+ *
+ * called under the reader lock
+ *
+ * returns the number of slots skipped or released
+ */
+static size_t mp_skip_void(shr *s) {
+  size_t n = 0, z = 0, f = 0, ws, c, p;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  ws = __atomic_load_n(&r->ws, __ATOMIC_ACQUIRE);
+  while (r->rc < ws) {
+    p = r->rc % r->mm;
+    c = __atomic_load_n(&mv[ p ].c, __ATOMIC_ACQUIRE);
+    if (c == r->rc + 1) break;
+    if ((c != ((r->rc + 1) | MP_VOID)) &&
+        (alive(s, mv[ p ].o) ||
+         !__atomic_compare_exchange_n(&mv[ p ].c, &c, (r->rc + 1) | MP_VOID, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)))
+      break;
+    z += mv[ p ].len;
+    mp_free_slot(&mv[ p ]);
+    r->r = (r->r + 1) % r->mm;
+    r->rc++;
+    n++;
+  }
+  stat_add(s, &s->ss->bd, z);
+  stat_add(s, &s->ss->md, n);
+
+  /* the eldest claim held by a dead reader */
+  while (r->rs < r->rc) {
+    p = r->rs % r->mm;
+    if (__atomic_load_n(&mv[ p ].c, __ATOMIC_ACQUIRE) == 0) break;
+    if (alive(s, mv[ p ].o)) break;
+    mp_free_slot(&mv[ p ]);
+    mp_free_prefix(r);
+    f++;
+  }
+  mp_free_prefix(r);
+  if ((n + f) && (wake_wanted(s, &r->wwait, R2W, WAKE_ALL, 0) < 0)) return 0;
+
+  return n + f;
+}
+
+/*
+ * skip_void
+ *
+ * move the read position past the void slots there (see void_slot),
+ * voiding that of a dead writer on the way. their messages count as
+ * dropped. a farm reader moves its own position.
+ *
+ * called under the reader lock (or without it, by farm readers)
+ *
+ * returns the number of slots skipped
+ */
+static size_t skip_void(shr *s) {
+  size_t n = 0, z = 0, q, mp;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  if (r->gflags & SHR_MP) return mp_skip_void(s);
+  if (r->gflags & SHR_SPSC) return 0;
+  if (__atomic_load_n(&r->fly, __ATOMIC_SEQ_CST) == 0) return 0;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  /* as in farm_msg_info, the slots are those of
+   * messages s->q on if r->q holds still meanwhile */
+  if (r->gflags & SHR_FARM) {
+    do {
+      q = __atomic_load_n(&r->q, __ATOMIC_ACQUIRE);
+      mp = __atomic_load_n(&r->mp, __ATOMIC_ACQUIRE);
+      for(n = 0; (s->q + n >= q) && (s->q + n < q + mp) &&
+                 void_slot(s, &mv[ (s->q + n) % r->mm ]); n++) ;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&r->q, __ATOMIC_ACQUIRE) != q);
+    s->q += n;
+    s->md += n;
+    return n;
+  }
+
+  while ((n < __atomic_load_n(&r->m, __ATOMIC_ACQUIRE)) &&
+         void_slot(s, &mv[ r->r ])) {
+    z += mv[ r->r ].len;
+    r->r = (r->r + 1) % r->mm;
+    n++;
+  }
+  if (n == 0) return 0;
+
+  __atomic_sub_fetch(&r->u, z, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&r->m, n, __ATOMIC_SEQ_CST);
+  stat_add(s, &s->ss->bd, z);
+  stat_add(s, &s->ss->md, n);
+  return n;
+}
+
+/* readiness hint for spin_wait, for a reader */
+static int data_ready(shr *s, size_t len, size_t niov) {
+  unsigned long long tmo;
+  size_t pos, ml;
+  (void)len; (void)niov;
+  return next_msg_info(s, 0, &pos, &ml) && wm_ready(s, &tmo);
+}
+
+/*
+ * await_msgs
+ *
+ * test or await data availability, for shr_readv and shr_read_peek.
+ * a blocking reader waits for a message (one that meets its watermarks,
+ * if it has any); a non-blocking one only looks. *tmo gets the time
+ * left until unread data short of the watermarks is due (see wm_ready).
+ *
+ * returns
+ *   1  a message is ready at *pos, of length *ml; with the lock held
+ *   0  none, in non-blocking mode; with the lock held
+ *  <0  error (-1) or caller descriptor ready (-3); lock not held
+ */
+static int await_msgs(shr *s, size_t *pos, size_t *ml,
+                      unsigned long long *tmo) {
+  int sc, msg_ready, spun = 0, gen;
+
+  while (1) {
+
+    gen = wait_gen(s, W2R);
+    sc = lock_io(s);
+    if (sc < 0) return -1;
+
+    *tmo = 0;
+    msg_ready = next_msg_info(s, 0, pos, ml);
+    if (msg_ready && wm_ready(s, tmo)) break;
+
+    /* spin a while before asking for a wakeup. see SHR_SPIN */
+    if (s->spin_max && !spun && ((s->flags & SHR_NONBLOCK) == 0)) {
+      spun = 1;
+      unlock_io(s);
+      spin_wait(s, data_ready, 0, 0);
+      continue;
+    }
+
+    /* the writer of the message at the read position may have
+     * died copying it in. if so, skip it, and look again */
+    if ((msg_ready == 0) && skip_void(s)) {
+      unlock_io(s);
+      continue;
+    }
+
+    /* a writer may commit under its own lock domain meanwhile.
+     * clear the fd, ask the writer for a wakeup, then look again,
+     * so the wakeup isn't lost */
+    if (s->flags & SHR_NONBLOCK) bw_force(s->w2r, 0);
+    want_wake(s->rwant);
+    msg_ready = next_msg_info(s, 0, pos, ml);
+    if (msg_ready && wm_ready(s, tmo)) break;
+
+    /* or a writer gave up its slot meanwhile (see shr_write_abort) */
+    if ((msg_ready == 0) && skip_void(s)) {
+      unlock_io(s);
+      continue;
+    }
+
+    if (s->flags & SHR_NONBLOCK) return 0;
+
+    /* blocking wait, until woken, or until the delay runs out
+     * on unread data short of the watermarks. awake/retry */
+    unlock_io(s);
+    sc = wait_ul(s, W2R, gen, *tmo);
+    if (sc) return sc; /* see bw_ctl BW_POLLFD */
+  }
+
+  if (s->r->gflags & SHR_SPSC) no_wake(s->rwant);
+  return 1;
+}
+
+/*
+ * arm_timer
+ *
+ * a poller with a delay watermark has a timer for the unread data
+ * short of its watermarks; it's set to the time left (tmo), or
+ * cleared if the reader is ready (or has no such data).
+ */
+static int arm_timer(shr *s, int ready, unsigned long long tmo) {
+  struct itimerspec its;
+
+  if (s->tfd == -1) return 0;
+
+  memset(&its, 0, sizeof(its));
+  if (ready == 0) {
+    its.it_value.tv_sec = tmo / 1000000000ULL;
+    its.it_value.tv_nsec = tmo % 1000000000ULL;
+  }
+  if (timerfd_settime(s->tfd, 0, &its, NULL) < 0) {
+    shr_log("timerfd_settime: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * read_done
+ *
+ * after a read releases its messages (mc of them, nr bytes): count
+ * them, wake writers waiting for the space, and set the readiness of
+ * the reader's fd (and its timer) by what remains unread.
+ *
+ * called under the reader lock (or without it, by SHR_SPSC and farm readers)
+ */
+static int read_done(shr *s, size_t mc, size_t nr) {
+  unsigned long long tmo = 0;
+  size_t pos, ml;
+  shr_ctrl *r = s->r;
+  int msg_ready;
+
+  msg_ready = next_msg_info(s, 0, &pos, &ml);
+  if ((msg_ready == 0) && r->wm_ns) __atomic_store_n(&r->wm_t0, 0,
+                                                      __ATOMIC_SEQ_CST);
+  if (msg_ready) msg_ready = wm_ready(s, &tmo);
+  stat_add(s, &s->ss->br, nr);
+  stat_add(s, &s->ss->mr, mc);
+  if (r->gflags & SHR_SPSC) {
+    if (nr > 0) wake_if_wanted(s, &r->wwait, R2W, WAKE_ALL);
+  }
+  else if (nr > 0) {
+    wake_wanted(s, &r->wwait, R2W, WAKE_ALL, 0);
+  }
+
+  /* a poller that emptied the ring gets its fd cleared, and asks
+   * for the wakeup that will set it. then it looks again, as a
+   * writer may have committed meanwhile */
+  if ((s->flags & SHR_NONBLOCK) && (msg_ready == 0)) {
+    bw_force(s->w2r, 0);
+    want_wake(s->rwant);
+    msg_ready = next_msg_info(s, 0, &pos, &ml);
+    if (msg_ready) msg_ready = wm_ready(s, &tmo);
+    if (msg_ready) bw_force(s->w2r, 1);
+  }
+  else if (s->fwait == 0) bw_force(s->w2r, msg_ready);
+  if (shr_sync(s) < 0) return -1;
+
+  return arm_timer(s, msg_ready, tmo);
+}
+
+/*
+ * read_batch
+ *
+ * for shr_readv and shr_read_packed: read messages into buf, back to
+ * back, and fill in batch b with their lengths (b->buf is buf). niov is
+ * IN/OUT: the room in b, in messages, and the number read. see shr_readv
+ *
+ */
+static ssize_t read_batch(shr *s, char *buf, size_t len, struct batch *b,
+                          size_t *niov) {
+  size_t mc = 0, ml, pos, start, first, viov;
+  int sc, rc = -1, msg_ready;
+  unsigned long long tmo;
+  shr_ctrl *r = s->r;
+  size_t nr=0;
+
+  assert(s->flags & SHR_RDONLY);
+
+  if (len == 0) goto done;
+  if (*niov == 0) goto done;
+  if (s->flags & SHR_MONITOR) {
+    shr_log("shr_readv: ring opened as a monitor\n");
+    goto done;
+  }
+  if (s->pk_mc) {
+    shr_log("shr_readv: peeked messages not released\n");
+    goto done;
+  }
+  if (len > SSIZE_MAX) len = SSIZE_MAX;
+  viov = *niov;
+
+ again:
+  msg_ready = await_msgs(s, &pos, &ml, &tmo);
+  if (msg_ready < 0) {
+    rc = msg_ready;
+    goto done;
+  }
+  if (msg_ready == 0) {
+    rc = arm_timer(s, 0, tmo);
+    goto done;
+  }
+
+  /* reached when data is available. lay out
+   * the messages that fit in the caller buf */
+  start = pos;
+  while (msg_ready) {
+    if (mc == viov) break; /* caller iov exhausted */
+    if (nr + ml > len) break; /* caller buf exhausted */
+    if (b->iov) {
+      b->iov[mc].iov_base = buf + nr;
+      b->iov[mc].iov_len = ml;
+    } else {
+      if (ml > UINT32_MAX) break; /* length won't fit */
+      b->lens[mc] = ml;
+    }
+    nr += ml;
+    mc++;
+    msg_ready = next_msg_info(s, mc, &pos, &ml);
+  }
+
+  /* the messages lie back to back in the ring,
+   * as they will in buf: copy them in one span */
+  if (mc > 0) {
+    first = claim_msgs(s, mc, nr);
+    unlock_io(s);
+    span_out(r, start, buf, nr);
+    if (lock_io(s) < 0) goto done;
+    mc = release_msgs(s, first, mc, &nr, b);
+
+    /* farm reader lost all it copied to a writer */
+    if (mc == 0) {
+      unlock_io(s);
+      goto again;
+    }
+  }
+
+  sc = read_done(s, mc, nr);
+  if (sc < 0) goto done;
+  rc = (mc > 0) ? 0 : -2;
+
+ done:
+  unlock_io(s);
+  *niov = mc;
+  return (rc == 0) ? (ssize_t)nr : rc;
+}
+
+/*
+ * read multiple messages from ring
+ *
+ * also see shr_read
+ *
+ * the function copies ring data into buf, and populates the struct iovec
+ * array so each one points to a message in buf.  the caller provides the
+ * uninitialized array of iov and this function fills them in. niov is an
+ * IN/OUT parameter; on input it's the number of structures in iov, and on
+ * output it's how many this function filled in.
+ *
+ * the messages are claimed under the ring lock, copied out without it,
+ * and released under the lock again. so the lock hold time does not grow
+ * with the size of the messages. farm readers skip the lock altogether.
+ *
+ * returns:
+ *   > 0 (number of bytes read from the ring)
+ *   0   (no data in ring, in non-blocking mode)
+ *  -1   (error)
+ *  -2   (buffer can't hold message)
+ *  -3   (caller descriptor became ready while blocked; see bw_ctl BW_POLLFD)
+ *
+ */
+ssize_t
+shr_readv(shr *s, char *buf, size_t len, struct iovec *iov, size_t *niov) {
+  struct batch b = { .iov = iov, .buf = buf };
+  return read_batch(s, buf, len, &b, niov);
+}
+
+/*
+ * shr_read_packed
+ *
+ * read multiple messages from ring, as shr_readv does, into buf back
+ * to back. instead of an iovec per message, the length of message k
+ * is put in lens[k]; it starts where message k-1 ends. niov is IN/OUT:
+ * the number of lens on input, the number of messages read on output.
+ *
+ * returns as shr_readv
+ */
+ssize_t shr_read_packed(shr *s, char *buf, size_t len, uint32_t *lens,
+                        size_t *niov) {
+  struct batch b = { .buf = buf, .lens = lens };
+  return read_batch(s, buf, len, &b, niov);
+}
+
+/*
+ * shr_read_peek
+ *
+ * read messages in place, without copying them out of the ring. this
+ * waits for messages as shr_readv does, then claims those at the read
+ * position, and points the caller's iov at them in the ring. message k
+ * lies in iov[2k] and iov[2k+1]; the second part is empty unless the
+ * message wraps around the end of the ring. niov is IN/OUT: on input
+ * the number of iov (two per message), on output the messages peeked.
+ *
+ * the messages stay in place, safe from writers, until the caller
+ * gives them back with shr_read_release. until then the handle can't
+ * read or peek again. writers may wait for the space they occupy,
+ * even in SHR_DROP mode, so they should be released soon. farm
+ * readers can't keep writers off their messages; they can't peek.
+ *
+ * returns:
+ *   > 0 (number of bytes peeked)
+ *   0   (no data in ring, in non-blocking mode)
+ *  -1   (error)
+ *  -3   (caller descriptor became ready while blocked; see bw_ctl BW_POLLFD)
+ */
+ssize_t shr_read_peek(shr *s, struct iovec *iov, size_t *niov) {
+  size_t mc = 0, ml, pos, l1, viov, nr = 0;
+  int rc = -1, msg_ready;
+  unsigned long long tmo;
+  shr_ctrl *r = s->r;
+
+  assert(s->flags & SHR_RDONLY);
+
+  if (r->gflags & SHR_FARM) {
+    shr_log("shr_read_peek: not supported on farm rings\n");
+    goto done;
+  }
+  if (s->flags & SHR_MONITOR) {
+    shr_log("shr_read_peek: ring opened as a monitor\n");
+    goto done;
+  }
+  if (s->pk_mc) {
+    shr_log("shr_read_peek: peeked messages not released\n");
+    goto done;
+  }
+  viov = *niov / 2;
+  if (viov == 0) goto done;
+
+  msg_ready = await_msgs(s, &pos, &ml, &tmo);
+  if (msg_ready < 0) {
+    rc = msg_ready;
+    goto done;
+  }
+  if (msg_ready == 0) {
+    rc = arm_timer(s, 0, tmo);
+    goto done;
+  }
+
+  while (msg_ready && (mc < viov)) {
+    l1 = head_len(r, pos, ml);
+    iov[2*mc].iov_base = r->d + pos;
+    iov[2*mc].iov_len = l1;
+    iov[2*mc+1].iov_base = r->d;
+    iov[2*mc+1].iov_len = ml - l1;
+    nr += ml;
+    mc++;
+    msg_ready = next_msg_info(s, mc, &pos, &ml);
+  }
+
+  if (mc > 0) {
+    s->pk_first = claim_msgs(s, mc, nr);
+    s->pk_mc = mc;
+    s->pk_nr = nr;
+  }
+  rc = 0;
+
+ done:
+  unlock_io(s);
+  *niov = mc;
+  return (rc == 0) ? (ssize_t)nr : rc;
+}
+
+/*
+ * shr_read_release
+ *
+ * give back the messages from shr_read_peek; their space is freed
+ * for writers, and blocked writers waiting for it are woken. it is a
+ * no-op if there are none.
+ *
+ * returns
+ *  0 on success
+ * -1 on error
+ */
+int shr_read_release(shr *s) {
+  size_t mc = s->pk_mc, nr = s->pk_nr;
+  int rc = -1;
+
+  assert(s->flags & SHR_RDONLY);
+
+  if (mc == 0) return 0;
+
+  if (lock_io(s) < 0) goto done;
+  release_msgs(s, s->pk_first, mc, &nr, NULL);
+  s->pk_mc = 0;
+  if (read_done(s, mc, nr) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlock_io(s);
+  return rc;
+}
+
+/* readiness hint for spin_wait, for a writer */
+static int space_ready(shr *s, size_t len, size_t niov) {
+  shr_ctrl *r = s->r;
+  size_t ws, wb;
+
+  if (r->gflags & SHR_MP) {
+    mp_reserved(r, &ws, &wb);
+    return mp_has_space(r, ws, wb, len, niov);
+  }
+
+  return has_space(r, len, niov);
+}
+
+/*
+ * poll_room
+ *
+ * keep a polling writer's fd (SHR_WRROOM) readable while the ring has
+ * its room free. once it hasn't, clear the fd, and ask the readers to
+ * wake it once the room is there (want_room); then look again, since
+ * a reader may have freed it meanwhile. called after each write.
+ */
+static int poll_room(shr *s) {
+  int ready;
+
+  if (s->room_m == 0) return 0;
+
+  ready = space_ready(s, s->room_b, s->room_m);
+  if (ready == 0) {
+    if (bw_force(s->r2w, 0) < 0) return -1;
+    want_room(s->r, s->room_b, s->room_m);
+    want_wake(&s->r->wwait);
+    ready = space_ready(s, s->room_b, s->room_m);
+    if (ready == 0) return 0;
+  }
+
+  return bw_force(s->r2w, 1);
+}
+
+/*
+ * mp_write
+ *
+ * write_batch for SHR_MP rings. the writers don't take the ring lock.
+ * the slot at r->ws is the reservation point. a writer claims it, by
+ * setting its owner from 0 to its own client id (see mp_claim), fills
+ * in its slots, and advances r->ws past them, which passes the point
+ * on. that takes a few instructions; the copy into the ring comes
+ * after, in parallel with other writers. each slot is then committed
+ * by storing its sequence number in it. readers consume the committed
+ * slots in order.
+ *
+ * a writer short of space lets go of the point before it waits, so it
+ * holds up no one. a point held by a writer that died is taken over.
+ * a slot reserved by a writer that died before committing it is given
+ * up by the readers (see mp_skip_void).
+ */
+#define MP_SPINS 100
+
+/*
+ * mp_claim
+ *
+ * claim the reservation point, as above. *ws is then its sequence
+ * number, and *wb the bytes reserved before it. if another writer
+ * holds the point for MP_SPINS tries, look at it: take it over if
+ * its holder died; if not, yield to it, and try again. it holds the
+ * point only while it fills in its slots, so even a non-blocking
+ * writer waits for it, rather than take it for a lack of room.
+ *
+ * returns
+ *   1  claimed; r->ws is ours to advance
+ *   0  the ring has no free slot
+ */
+static int mp_claim(shr *s, size_t *ws, size_t *wb) {
+  size_t o, p, rs, last = 0, spins = 0;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  while (1) {
+    rs = __atomic_load_n(&r->rs, __ATOMIC_ACQUIRE);
+    *ws = __atomic_load_n(&r->ws, __ATOMIC_ACQUIRE);
+    if (*ws - rs >= r->mm) return 0;
+    if (*ws != last) spins = 0;
+    last = *ws;
+    p = *ws % r->mm;
+
+    o = 0;
+    if (__atomic_compare_exchange_n(&mv[ p ].o, &o, s->cid, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      if (__atomic_load_n(&r->ws, __ATOMIC_SEQ_CST) == *ws) break;
+      /* the point moved on before we claimed it */
+      o = s->cid;
+      __atomic_compare_exchange_n(&mv[ p ].o, &o, 0, 0,
+                                  __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    if (++spins < MP_SPINS) {
+      cpu_relax();
+      continue;
+    }
+
+    if ((__atomic_load_n(&r->ws, __ATOMIC_SEQ_CST) == *ws) &&
+        (alive(s, o) == 0) &&
+        __atomic_compare_exchange_n(&mv[ p ].o, &o, s->cid, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      break;
+    sched_yield();
+  }
+
+  *wb = mp_wb(r, *ws);
+  return 1;
+}
+
+/* let go of the reservation point, unused */
+static void mp_unclaim(shr *s, size_t ws) {
+  struct msg *mv;
+
+  mv = (struct msg*)(s->r->d + s->r->n + s->r->pad_len);
+  __atomic_store_n(&mv[ ws % s->r->mm ].o, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * mp_await_room
+ *
+ * claim the reservation point once the SHR_MP ring has room past it
+ * for len bytes in niov messages, waiting for the room if need be.
+ *
+ * returns
+ *   1  room; the point is claimed, at *ws and *wb (see mp_claim)
+ *   0  no room, in non-blocking mode
+ *  <0  error (-1) or caller descriptor ready (-3)
+ */
+static int mp_await_room(shr *s, size_t len, size_t niov, size_t *ws,
+                         size_t *wb) {
+  int sc, spun = 0, gen;
+  shr_ctrl *r = s->r;
+
+  while (1) {
+    gen = wait_gen(s, R2W);
+    sc = mp_claim(s, ws, wb);
+    if (sc && mp_has_space(r, *ws, *wb, len, niov)) return 1;
+    if (sc) mp_unclaim(s, *ws);
+    if (s->flags & SHR_NONBLOCK) return 0;
+
+    /* spin a while, unclaimed, before asking for a wakeup */
+    if (s->spin_max && !spun) {
+      spun = 1;
+      spin_wait(s, space_ready, len, niov);
+      continue;
+    }
+
+    /* ask a reader to wake us, look again */
+    want_room(r, len, niov);
+    want_wake(&r->wwait);
+    if (space_ready(s, len, niov)) continue;
+
+    sc = wait_ul(s, R2W, gen, 0);
+    if (sc) return sc;
+  }
+}
+
+/*
+ * mp_reserve
+ *
+ * with the reservation point claimed, at ws and wb, reserve the slots
+ * for the niov messages of batch b, and pass the point on.
+ */
+static void mp_reserve(shr *s, size_t ws, size_t wb, struct batch *b,
+                       size_t niov) {
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+  size_t i, p;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  for(i=0; i < niov; i++) {
+    p = (ws + i) % r->mm;
+    mv[ p ].pos = wb;
+    mv[ p ].len = batch_len(b, i);
+    mv[ p ].o = s->cid;
+    wb += mv[ p ].len;
+  }
+  __atomic_store_n(&r->ws, ws + niov, __ATOMIC_SEQ_CST);
+}
+
+static ssize_t mp_write(shr *s, struct batch *b, size_t niov, size_t len) {
+  size_t ws, wb, i, p;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+  int rc = -1, sc;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  sc = mp_await_room(s, len, niov, &ws, &wb);
+  if (sc < 0) return sc;
+  if (sc == 0) return (poll_room(s) < 0) ? -1 : 0;
+
+  /* reserve, then copy the data in */
+  mp_reserve(s, ws, wb, b, niov);
+  copy_in(r, wb % r->n, b, niov, len);
+
+  /* commit */
+  for(i=0; i < niov; i++) {
+    p = (ws + i) % r->mm;
+    __atomic_store_n(&mv[ p ].c, ws + i + 1, __ATOMIC_SEQ_CST);
+  }
+
+  stat_add(s, &s->ss->bw, len);
+  stat_add(s, &s->ss->mw, niov);
+
+  if (wake_if_wanted(s, &r->rwait, W2R, niov) < 0) goto done;
+  if (poll_room(s) < 0) goto done;
+  if (shr_sync(s) < 0) goto done;
+  rc = 0;
+
+ done:
+  return (rc == 0) ? (ssize_t)len : -1;
+}
+
+/*
+ * await_room
+ *
+ * for shr_writev and shr_write_reserve (other than in SHR_MP mode):
+ * take the lock once the ring has room for len bytes in niov messages,
+ * reclaiming read messages (and in SHR_DROP mode, dropping unread ones)
+ * to make it. a blocking writer waits for the room; a non-blocking one
+ * only looks.
+ *
+ * returns
+ *   1  room; with the lock held
+ *   0  no room, in non-blocking mode; with the lock held
+ *  <0  error (-1) or caller descriptor ready (-3); lock not held
+ */
+static int await_room(shr *s, size_t len, size_t niov) {
+  int sc, room, busy, wip, spun = 0, gen;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  while (1) {
+    gen = wait_gen(s, R2W);
+    if (lock_io(s) < 0) return -1;
+
+    /* if ring has enough free space, break. in SHR_DROP
+     * mode, drop unread messages to make the space */
+    room = has_space(r, len, niov);
+    if ((room == 0) && (r->gflags & SHR_DROP))
+      busy = (drop_unread(s, len, niov) == 0);
+    else busy = 0;
+    wip = busy;
+    if (room || (r->gflags & SHR_DROP)) {
+      if (busy == 0) busy = (reclaim_eldest(s, len, niov) == 0);
+      if (busy == 0) break;
+    }
+
+    /* the room is there but a reader has a message in it, to
+     * copy out, or peeked for as long as it likes. wait for its
+     * release to wake us. in drop mode, what's in the way may
+     * instead be another writer's copy (SLOT_WRITING). that's
+     * soon over, and writers don't wake writers; so yield */
+    if (busy) {
+      if (s->flags & SHR_NONBLOCK) return 0;
+      if ((r->gflags & SHR_DROP) &&
+          (wip || (__atomic_load_n(&mv[ r->e ].c, __ATOMIC_ACQUIRE) !=
+                   SLOT_READING))) {
+        unlock_io(s);
+        sched_yield();
+        continue;
+      }
+      /* the room a drop mode writer needs isn't
+       * a matter of unread data, as room_met has it */
+      if ((r->gflags & SHR_DROP) == 0) want_room(r, len, niov);
+      want_wake(&r->wwait);
+      if (reclaim_eldest(s, len, niov)) break;
+      unlock_io(s);
+      sc = wait_ul(s, R2W, gen, 0);
+      if (sc) return sc;
+      continue;
+    }
+
+    /* readers stop at a message whose writer died copying it
+     * in, and the ring may stay full. void its slot, and wake
+     * the readers to skip it (see skip_void) */
+    if (((r->gflags & (SHR_DROP|SHR_SPSC)) == 0) &&
+        __atomic_load_n(&r->fly, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&r->m, __ATOMIC_ACQUIRE) &&
+        void_slot(s, &mv[ __atomic_load_n(&r->r, __ATOMIC_ACQUIRE) ]) &&
+        (wake_wanted(s, &r->rwait, W2R, WAKE_ALL, 0) < 0)) {
+      unlock_io(s);
+      return -1;
+    }
+
+    /* spin a while before asking for a wakeup. see SHR_SPIN */
+    if (s->spin_max && !spun && ((s->flags & SHR_NONBLOCK) == 0)) {
+      spun = 1;
+      unlock_io(s);
+      spin_wait(s, space_ready, len, niov);
+      continue;
+    }
+
+    /* ask a reader to wake us, look again */
+    if ((s->flags & SHR_NONBLOCK) == 0) {
+      want_room(r, len, niov);
+      want_wake(&r->wwait);
+      if (has_space(r, len, niov) && reclaim_eldest(s, len, niov)) break;
+    }
+
+    if (s->flags & SHR_NONBLOCK) return 0;
+
+    unlock_io(s);
+    sc = wait_ul(s, R2W, gen, 0);
+    if (sc) return sc;
+  }
+  if (r->gflags & SHR_SPSC) no_wake(&r->wwait);
+
+  /* sufficient free space has been made available. */
+  assert(r->n - r->u >= len);
+  assert(r->m + niov <= r->mm);
+  assert(r->mp <= r->mm);
+  return 1;
+}
+
+/*
+ * reserve_slots
+ *
+ * with the room made (see await_room), reserve the slots and space for
+ * the niov messages of batch b, len bytes in all. the messages count
+ * as unread from here, but they're SLOT_WRITING, so readers stop at
+ * them until they're committed (see commit_slots). other writers go on
+ * past them. a SHR_SPSC writer, alone, takes them only at the commit,
+ * so if it dies copying in, the next writer just writes over them.
+ * *pos gets the ring offset of the first message.
+ *
+ * called under the writer lock (or in SHR_SPSC mode, by its writer)
+ *
+ * returns the slot of the first message
+ */
+static size_t reserve_slots(shr *s, struct batch *b, size_t niov,
+                            size_t len, size_t *pos) {
+  size_t bsz, i, p, p0, at;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  p = ( r->e + r->mp ) % r->mm;
+  p0 = p;
+  *pos = r->i;
+  if ((r->gflags & SHR_SPSC) == 0)
+    __atomic_add_fetch(&r->fly, niov, __ATOMIC_SEQ_CST);
+  for(i=0, at=*pos; i < niov; i++) {
+    bsz = batch_len(b, i);
+    assert(bsz > 0);
+
+    mv[ p ].pos = at;
+    mv[ p ].len = bsz;
+    mv[ p ].o = s->cid;
+    if ((r->gflags & SHR_SPSC) == 0)
+      __atomic_store_n(&mv[ p ].c, SLOT_WRITING, __ATOMIC_RELAXED);
+    at = (at + bsz) % r->n;
+    p++;
+    if (p == r->mm) p = 0;
+  }
+  if ((r->gflags & SHR_SPSC) == 0) {
+    r->i = at;
+    __atomic_store_n(&r->mp, r->mp + niov, __ATOMIC_RELEASE);
+    /* readers hold the other lock domain. they see the slots
+     * marked before they see the messages. farm readers validate
+     * their copies against r->q after the fact; the full barrier
+     * orders its update before our copy */
+    __atomic_add_fetch(&r->u, len, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&r->m, niov, __ATOMIC_SEQ_CST);
+  }
+  return p0;
+}
+
+/*
+ * commit_slots
+ *
+ * after the copy, commit the niov messages (len bytes) reserved from
+ * slot p0 on by reserve_slots, and wake the readers. in SHR_SPSC mode,
+ * publish them to the reader: its acquire load of r->m orders our copy
+ * before its own. otherwise this takes the writer lock, and returns
+ * with it held (the caller unlocks, even on error).
+ *
+ * returns 0 on success, or as wake_wanted on error
+ */
+static int commit_slots(shr *s, size_t p0, size_t niov, size_t len) {
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+  size_t i, p;
+
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  stat_add(s, &s->ss->bw, len);
+  stat_add(s, &s->ss->mw, niov);
+
+  if (r->gflags & SHR_SPSC) {
+    r->i = (mv[ p0 ].pos + len) % r->n;
+    __atomic_store_n(&r->mp, r->mp + niov, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&r->u, len, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&r->m, niov, __ATOMIC_SEQ_CST);
+    return wake_if_wanted(s, &r->rwait, W2R, niov);
+  }
+
+  if (lock_io(s) < 0) return -1;
+  for(i=0, p=p0; i < niov; i++) {
+    __atomic_store_n(&mv[ p ].c, SLOT_READY, __ATOMIC_RELEASE);
+    p++;
+    if (p == r->mm) p = 0;
+  }
+  __atomic_sub_fetch(&r->fly, niov, __ATOMIC_SEQ_CST);
+  return wake_wanted(s, &r->rwait, W2R, niov, wm_wanted(r));
+}
+
+/*
+ * write_batch
+ *
+ * for shr_writev and shr_write_packed: write the niov messages of
+ * batch b, len bytes in all, into the ring; see shr_writev.
+ */
+static ssize_t write_batch(shr *s, struct batch *b, size_t niov, size_t len) {
+  size_t p0, pos;
+  shr_ctrl *r = s->r;
+  int rc = -1, sc;
+
+  if (r->gflags & SHR_MP) return mp_write(s, b, niov, len);
+
+  sc = await_room(s, len, niov);
+  if (sc < 0) return sc;
+  if (sc == 0) {
+    rc = poll_room(s);
+    len = 0;
+    goto done;
+  }
+
+  /* reserve, copy the data in without the lock, commit */
+  p0 = reserve_slots(s, b, niov, len, &pos);
+  unlock_io(s);
+  copy_in(r, pos, b, niov, len);
+  if (commit_slots(s, p0, niov, len)) goto done;
+  if (poll_room(s) < 0) goto done;
+  if (shr_sync(s) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlock_io(s);
+  return (rc == 0) ? (ssize_t)len : -1;
+}
+
+/*
+ * write sequential io buffers into ring
+ *
+ * if there is sufficient space in the ring - copy the whole iovec in.
+ * if there is insufficient free space in the ring- wait for space, or
+ * return 0 immediately in non-blocking mode. only writes all or nothing.
+ * each iovec element becomes one message.
+ *
+ * the space is reserved under the ring lock, the data copied in without
+ * it, and the messages committed under the lock again. so the lock hold
+ * time does not grow with the size of the messages.
+ *
+ * returns:
+ *   > 0 (number of bytes copied into ring, always the full iovec)
+ *   0   (insufficient space in ring, in non-blocking mode)
+ *  -1   (error, such as the iovec exceeds the total ring capacity)
+ *  -2   (not used)
+ *  -3   (caller descriptor became ready while blocked; see bw_ctl BW_POLLFD)
+ *
+ */
+ssize_t shr_writev(shr *s, struct iovec *iov, size_t niov) {
+  struct batch b = { .iov = iov };
+  size_t len=0, i;
+  ssize_t nr;
+
+  assert(s->flags & SHR_WRONLY);
+
+  if (s->rv_len) {
+    shr_log("shr_writev: reserved space not committed\n");
+    goto done;
+  }
+
+  for(i=0; i < niov; i++) {
+    len += iov[i].iov_len;
+    if (len == 0) goto done;
+    if (len > SSIZE_MAX) goto done;
     if (len > s->n) goto done;
     if (niov > s->mm) goto done;
   }
@@ -922,95 +3513,240 @@ ssize_t shr_writev(shr *s, struct iovec *iov, size_t niov) {
     s->c.vm = 0;
   }
 
-  while (1) {
-    if (lock(s->ring_fd) < 0) goto done;
+  return write_batch(s, &b, niov, len);
 
-    /* if ring has enough free space, break */
-    if ((r->n - r->u >= len) && 
-        (r->mm - r->m >= niov)) break;
+ done:
+  return -1;
+}
 
-    if (r->gflags & SHR_DROP) {
-      drop_unread(s, len, niov);
-      break;
-    }
+/*
+ * shr_write_packed
+ *
+ * write n messages, which lie back to back in buf, into the ring.
+ * message k is lens[k] bytes long, and starts where message k-1
+ * ends. otherwise as shr_writev: all or nothing, and the same returns.
+ */
+ssize_t shr_write_packed(shr *s, char *buf, uint32_t *lens, size_t n) {
+  struct batch b = { .buf = buf, .lens = lens };
+  size_t len=0, i;
+  ssize_t nr;
 
-    if (s->flags & SHR_NONBLOCK) {
-      rc = 0;
-      len = 0;
-      goto done;
-    }
+  assert(s->flags & SHR_WRONLY);
 
-    unlock(s->ring_fd);
-    sc = bw_wait_ul(s->r2w);
-    if (sc) return sc;
+  if (s->rv_len) {
+    shr_log("shr_write_packed: reserved space not committed\n");
+    return -1;
   }
 
-  /* sufficient free space has been made available. */
-  assert(r->n - r->u >= len);
-  assert(r->m + niov <= r->mm);
-  assert(r->mp <= r->mm);
+  if ((n == 0) || (n > s->mm)) return -1;
+  for(i=0; i < n; i++) {
+    if (lens[i] == 0) return -1;
+    len += lens[i];
+    if (len > s->n) return -1;
+  }
 
-  /* advance eldest position if our write will overwrite
-   * its data or occupy its slot in mv. copy volatile r->*
-   * to involatile locals here for speed; we hold lock */
-  a = 0;
-  e = r->e;
-  mp = r->mp;
-  i = r->i;
-  while (mp) {
-    if (i > mv[ e ].pos)
-      l = (r->n - i) + mv[ e ].pos;
-    else
-      l = mv[ e ].pos - i;
+  /* cached messages go first */
+  if (s->c.n) {
+    nr = shr_flush(s, 0);
+    if (nr <= 0) return nr;
+  }
 
-    if ((len <= l) && (s->mm - mp >= niov))
-      break;
+  return write_batch(s, &b, n, len);
+}
 
-    e++;
-    if (e == s->mm) e = 0;
-    a++;
-    mp--;
+/*
+ * shr_writemsg
+ *
+ * write n messages into the ring, each gathered from its segments:
+ * msgs[k] describes message k by an iovec of msgs[k].iovcnt segments.
+ * the segments are copied straight into the ring, back to back, so a
+ * message framed as a header and a payload needs no scratch copy.
+ * otherwise as shr_writev: all or nothing, and the same returns.
+ */
+ssize_t shr_writemsg(shr *s, struct shr_msg *msgs, size_t n) {
+  struct batch b = { .msgs = msgs };
+  size_t len=0, ml, i;
+  ssize_t nr;
+
+  assert(s->flags & SHR_WRONLY);
+
+  if (s->rv_len) {
+    shr_log("shr_writemsg: reserved space not committed\n");
+    return -1;
   }
-  r->e = e;
-  r->q += a;
-  r->mp = mp;
 
-  /* finally. copy the data in */
-  p = ( r->e + r->mp ) % r->mm;
+  if ((n == 0) || (n > s->mm)) return -1;
+  for(i=0; i < n; i++) {
+    ml = msg_len(&msgs[i]);
+    if ((ml == 0) || (ml > s->n)) return -1;
+    len += ml;
+    if (len > s->n) return -1;
+  }
 
-  for(i=0; i < niov; i++) {
-    buf = iov[i].iov_base;
-    bsz = iov[i].iov_len;
-    assert(bsz > 0);
+  /* cached messages go first */
+  if (s->c.n) {
+    nr = shr_flush(s, 0);
+    if (nr <= 0) return nr;
+  }
 
-    mv[ p ].pos = r->i;
-    mv[ p ].len = bsz;
+  return write_batch(s, &b, n, len);
+}
+
+/*
+ * shr_write_reserve
+ *
+ * reserve len bytes in the ring for one message, for the caller to
+ * fill in place. iov[0] and iov[1] are pointed at the space; the
+ * second part is empty unless the space wraps around the end of the
+ * ring. nothing is visible to readers until shr_write_commit, which
+ * makes it a message, or shr_write_abort, which gives the space back.
+ *
+ * the space is reserved as shr_writev reserves it before its copy, and
+ * no lock is held until the commit or abort. other writers go on past
+ * it, but readers wait at it, so fill it quickly.
+ *
+ * returns:
+ *   > 0 (len, the number of bytes reserved)
+ *   0   (insufficient space in ring, in non-blocking mode)
+ *  -1   (error, such as a reservation already outstanding)
+ *  -3   (caller descriptor became ready while blocked; see bw_ctl BW_POLLFD)
+ */
+ssize_t shr_write_reserve(shr *s, size_t len, struct iovec *iov) {
+  struct iovec io = { .iov_base = NULL };
+  struct batch b = { .iov = &io };
+  size_t pos, l1, ws, wb;
+  int rc = -1, sc;
+  shr_ctrl *r = s->r;
+  ssize_t nr;
 
-    msg_wraps = (r->i + bsz > r->n) ? 1 : 0;
-    l1 = msg_wraps ? (r->n - r->i) : bsz;
-    l2 = msg_wraps ? (bsz - l1) : 0;
+  assert(s->flags & SHR_WRONLY);
 
-    memcpy(r->d + r->i, buf, l1);
-    if (l2) memcpy(r->d, buf + l1, l2);
-    r->i = (r->i + bsz) % r->n;
-    p++;
-    if (p == r->mm) p = 0;
+  if (s->rv_len) {
+    shr_log("shr_write_reserve: reserved space not committed\n");
+    return -1;
+  }
+  if ((len == 0) || (len > s->n) || (len > SSIZE_MAX)) return -1;
+
+  /* cached messages go first */
+  if (s->c.n) {
+    nr = shr_flush(s, 0);
+    if (nr <= 0) return nr;
+  }
+
+  if (r->gflags & SHR_MP) {
+    sc = mp_await_room(s, len, 1, &ws, &wb);
+    if (sc < 0) return sc;
+    if (sc == 0) return (poll_room(s) < 0) ? -1 : 0;
+    io.iov_len = len;
+    mp_reserve(s, ws, wb, &b, 1);
+    s->rv_t = ws;
+    pos = wb % r->n;
+  } else {
+    sc = await_room(s, len, 1);
+    if (sc < 0) return sc;
+    if (sc == 0) {
+      rc = poll_room(s);
+      len = 0;
+      goto done;
+    }
+    io.iov_len = len;
+    s->rv_t = reserve_slots(s, &b, 1, len, &pos);
+    unlock_io(s);
+  }
+
+  l1 = head_len(r, pos, len);
+  iov[0].iov_base = r->d + pos;
+  iov[0].iov_len = l1;
+  iov[1].iov_base = r->d;
+  iov[1].iov_len = len - l1;
+  s->rv_len = len;
+  return len;
+
+ done:
+  unlock_io(s);
+  return (rc == 0) ? (ssize_t)len : -1;
+}
+
+/*
+ * shr_write_commit
+ *
+ * publish the space from shr_write_reserve as one message. readers
+ * see it now, and are woken as by shr_writev.
+ *
+ * returns
+ *  0 on success
+ * -1 on error
+ */
+int shr_write_commit(shr *s) {
+  size_t len = s->rv_len, p;
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+  int rc = -1;
+
+  assert(s->flags & SHR_WRONLY);
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  if (len == 0) {
+    shr_log("shr_write_commit: no space reserved\n");
+    return -1;
   }
+  s->rv_len = 0;
 
-  r->u += len;
-  r->mp += niov;
-  r->m += niov;
+  if (r->gflags & SHR_MP) {
+    p = s->rv_t % r->mm;
+    __atomic_store_n(&mv[ p ].c, s->rv_t + 1, __ATOMIC_SEQ_CST);
 
-  sc = bw_wake(s->w2r);
-  if (sc) goto done;
-  r->stat.bw += len;
-  r->stat.mw += niov;
+    stat_add(s, &s->ss->bw, len);
+    stat_add(s, &s->ss->mw, 1);
+    if (wake_if_wanted(s, &r->rwait, W2R, 1) < 0) goto done;
+    if (poll_room(s) < 0) goto done;
+    if (shr_sync(s) < 0) goto done;
+    rc = 0;
+    goto done;
+  }
+
+  if (commit_slots(s, s->rv_t, 1, len)) goto done;
+  if (poll_room(s) < 0) goto done;
   if (shr_sync(s) < 0) goto done;
   rc = 0;
 
  done:
-  unlock(s->ring_fd);
-  return (rc == 0) ? (ssize_t)len : -1;
+  unlock_io(s);
+  return rc;
+}
+
+/*
+ * shr_write_abort
+ *
+ * give back the space from shr_write_reserve unwritten. other writers
+ * may have reserved past it, so its slot is made void: readers skip it,
+ * counting it as dropped, and its space is freed as they pass it (see
+ * void_slot, mp_skip_void). readers waiting at it are woken to do so.
+ * in SHR_SPSC mode, where nothing is taken until the commit, the ring
+ * is as it was. in SHR_DROP mode, the unread messages dropped to make
+ * the space stay dropped. it is a no-op if there is none.
+ *
+ * returns
+ *  0 on success
+ * -1 on error
+ */
+int shr_write_abort(shr *s) {
+  shr_ctrl *r = s->r;
+  struct msg *mv;
+
+  assert(s->flags & SHR_WRONLY);
+  mv = (struct msg*)(r->d + r->n + r->pad_len);
+
+  if (s->rv_len == 0) return 0;
+  s->rv_len = 0;
+
+  if (r->gflags & SHR_SPSC) return 0;
+  if (r->gflags & SHR_MP)
+    __atomic_store_n(&mv[ s->rv_t % r->mm ].c, (s->rv_t + 1) | MP_VOID,
+                     __ATOMIC_SEQ_CST);
+  else
+    __atomic_store_n(&mv[ s->rv_t ].c, SLOT_VOID, __ATOMIC_SEQ_CST);
+  return wake_if_wanted(s, &r->rwait, W2R, WAKE_ALL);
 }
 
 /*
@@ -1043,7 +3779,7 @@ int shr_appdata(shr *s, void **get, void *set, size_t *sz) {
   int rc = -1;
   char *ad;
 
-  if (lock(s->ring_fd) < 0) goto done;
+  if (lock(s) < 0) goto done;
   if (r->app_len == 0) goto done;
 
   /* appdata is stored after ring data and after mv list */
@@ -1079,7 +3815,7 @@ int shr_appdata(shr *s, void **get, void *set, size_t *sz) {
   rc = 0;
 
  done:
-  unlock(s->ring_fd);
+  unlock(s);
   return rc;
 }
 
@@ -1120,9 +3856,9 @@ ssize_t shr_flush(struct shr *s, int wait) {
 
     /* to block, a writer needs the r2w handle */
     if (s->r2w == NULL) {
-      if (lock(s->ring_fd) < 0) goto done;
+      if (lock(s) < 0) goto done;
       s->r2w = bw_open(BW_WAIT, &s->r->r2w, &s->wait_fd);
-      unlock(s->ring_fd);
+      unlock(s);
       if (s->r2w == NULL) goto done;
     }
   }
@@ -1155,20 +3891,26 @@ ssize_t shr_flush(struct shr *s, int wait) {
  */
 void shr_close(struct shr *s) {
   
-  /* flush cache */
+  /* flush cache, give back peeked messages or reserved space */
+  if (s->rv_len) shr_write_abort(s);
   if (s->c.n) shr_flush(s,0);
+  if (s->pk_mc) shr_read_release(s);
 
   /* release bw handles under lock.
    * don't close s->wait_fd- bw does! */
-  if (lock(s->ring_fd) < 0) goto end;
+  if (lock(s) < 0) goto end;
   if (s->w2r) bw_close(s->w2r);
   if (s->r2w) bw_close(s->r2w);
-  unlock(s->ring_fd);
+  release_role(s);
+  stat_release(s);
+  unlock(s);
 
  end:
   /* free the cache if any */
   if (s->c.buf) free(s->c.buf);
   if (s->c.iov) free(s->c.iov);
+  if (s->efd != -1) close(s->efd);
+  if (s->tfd != -1) close(s->tfd);
   /* unmap the ring buffer */
   assert(s->buf);
   munmap(s->buf, s->s.st_size);
@@ -1176,6 +3918,119 @@ void shr_close(struct shr *s) {
   free(s);
 }
 
+/*
+ * set_wm
+ *
+ * set one of the reader watermarks (see wm_due) of this handle. they're
+ * kept in its stats slot, so the writers can find the lowest. a non-
+ * blocking reader with a delay gets a timer, and an epoll descriptor
+ * over the timer and its wait fd, for the caller to poll.
+ */
+static int set_wm(shr *s, int flag, size_t v) {
+  struct epoll_event ev = { .events = EPOLLIN };
+  shr_ctrl *r = s->r;
+  int rc = -1, sc;
+
+  if (((s->flags & SHR_RDONLY) == 0) || (r->gflags & SHR_FARM)) {
+    shr_log("shr_ctl: watermarks are for readers of non-farm rings\n");
+    goto done;
+  }
+
+  if ((flag == SHR_RDMAX_DELAY) && v && (s->flags & SHR_NONBLOCK) &&
+      (s->tfd == -1)) {
+    s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (s->tfd < 0) {
+      shr_log("timerfd_create: %s\n", strerror(errno));
+      goto done;
+    }
+    s->efd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->efd < 0) {
+      shr_log("epoll_create1: %s\n", strerror(errno));
+      close(s->tfd);
+      s->tfd = -1;
+      goto done;
+    }
+    ev.data.fd = s->wait_fd;
+    sc = epoll_ctl(s->efd, EPOLL_CTL_ADD, s->wait_fd, &ev);
+    if (sc == 0) {
+      ev.data.fd = s->tfd;
+      sc = epoll_ctl(s->efd, EPOLL_CTL_ADD, s->tfd, &ev);
+    }
+    if (sc < 0) {
+      shr_log("epoll_ctl: %s\n", strerror(errno));
+      close(s->efd);
+      close(s->tfd);
+      s->efd = s->tfd = -1;
+      goto done;
+    }
+  }
+
+  if (lock(s) < 0) goto done;
+
+  if (s->ss == &r->rest) {
+    shr_log("shr_ctl: too many clients for watermarks\n");
+    unlock(s);
+    goto done;
+  }
+
+  switch(flag) {
+    case SHR_RDMIN_MSGS:  s->wm_m = v; break;
+    case SHR_RDMIN_BYTES: s->wm_b = v; break;
+    default:              s->wm_ns = v * 1000ULL; break;
+  }
+  s->ss->wm_m = s->wm_m;
+  s->ss->wm_b = s->wm_b;
+  s->ss->wm_ns = s->wm_ns;
+  wm_sync(r);
+  s->rwant = (s->wm_m || s->wm_b || s->wm_ns) ? &r->rwm : &r->rwait;
+
+  /* this reader waits on its watermarks from here */
+  want_wake(s->rwant);
+  unlock(s);
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/*
+ * set_room
+ *
+ * let a non-blocking writer poll for room to write (see poll_room).
+ * it opens the r2w wait handle that blocking writers have, and its
+ * wait fd becomes the selectable fd. 0 bytes or msgs counts as 1.
+ */
+static int set_room(shr *s, size_t len, size_t niov) {
+  shr_ctrl *r = s->r;
+  int rc = -1;
+
+  if (((s->flags & SHR_WRONLY) == 0) || ((s->flags & SHR_NONBLOCK) == 0) ||
+      (r->gflags & SHR_DROP)) {
+    shr_log("shr_ctl: SHR_WRROOM is for non-blocking, non-drop writers\n");
+    goto done;
+  }
+
+  if ((len > s->n) || (niov > s->mm)) {
+    shr_log("shr_ctl: room %zu bytes %zu msgs exceeds ring\n", len, niov);
+    goto done;
+  }
+
+  if (s->r2w == NULL) {
+    if (lock(s) < 0) goto done;
+    s->r2w = bw_open(BW_WAIT, &r->r2w, &s->wait_fd);
+    unlock(s);
+    if (s->r2w == NULL) goto done;
+  }
+
+  s->room_b = len ? len : 1;
+  s->room_m = niov ? niov : 1;
+  if (poll_room(s) < 0) goto done;
+  rc = 0;
+
+ done:
+  return rc;
+}
+
 /*
  * shr_ctl
  *
@@ -1186,6 +4041,14 @@ void shr_close(struct shr *s) {
  *  -----------   ---------  ----------------------------------------------
  *  SHR_POLLFD    int fd     add fd to epoll set when blocked internally in
  *                           shr_read/write, cause it to return -3 if ready
+ *  SHR_SPIN      unsigned   spin up to this many usec (adaptively) before
+ *                           blocking in shr_read/write; 0 to not spin
+ *  SHR_RDMIN_MSGS  size_t   reader: wait for this many unread messages
+ *  SHR_RDMIN_BYTES size_t   reader: or this many unread bytes
+ *  SHR_RDMAX_DELAY unsigned reader: or for unread data this many usec old
+ *                           (0 turns each off; see wm_due)
+ *  SHR_WRROOM  size_t bytes non-blocking writer: make the selectable fd
+ *              size_t msgs  readable while this much room is free
  *
  * returns
  *  0 on success
@@ -1193,15 +4056,38 @@ void shr_close(struct shr *s) {
  */
 int shr_ctl(shr *s, int flag, ...) {
   int rc = -1, fd, sc;
+  unsigned usec;
+  size_t v, m;
 
   va_list ap;
   va_start(ap, flag);
 
+  /* these all tune reads or writes */
+  if (s->flags & SHR_MONITOR) {
+    shr_log("shr_ctl: ring opened as a monitor\n");
+    goto done;
+  }
+
   switch(flag) {
 
     case SHR_POLLFD:
       fd = (int)va_arg(ap, int);
 
+      /* a handle blocking on a futex can't watch a descriptor too;
+       * it moves over to blocking on the bw handle, which can */
+      if (s->fwait) {
+        if (lock(s) < 0) goto done;
+        if (s->flags & SHR_RDONLY) {
+          s->w2r = bw_open(BW_WAIT, &s->r->w2r, &s->wait_fd);
+          if (s->w2r) bw_force(s->w2r, unread_bytes(s->r) ? 1 : 0);
+        } else
+          s->r2w = bw_open(BW_WAIT, &s->r->r2w, &s->wait_fd);
+        unlock(s);
+        if ((s->flags & SHR_RDONLY) && (s->w2r == NULL)) goto done;
+        if ((s->flags & SHR_WRONLY) && (s->r2w == NULL)) goto done;
+        s->fwait = 0;
+      }
+
       /* add the fd to be monitored to the "wait" mode bw depending on r vs w */
       sc = 0;
       if ((s->flags & SHR_WRONLY) && s->r2w) sc = bw_ctl(s->r2w, BW_POLLFD, fd);
@@ -1212,6 +4098,33 @@ int shr_ctl(shr *s, int flag, ...) {
       }
       break;
 
+    case SHR_SPIN:
+      usec = (unsigned)va_arg(ap, unsigned);
+      if (usec > SHR_SPIN_MAX) {
+        shr_log("shr_ctl: spin time %u exceeds %u usec\n", usec, SHR_SPIN_MAX);
+        goto done;
+      }
+      s->spin_max = usec * 1000;
+      s->spin_lim = s->spin_max;
+      break;
+
+    case SHR_RDMIN_MSGS:
+    case SHR_RDMIN_BYTES:
+      v = (size_t)va_arg(ap, size_t);
+      if (set_wm(s, flag, v) < 0) goto done;
+      break;
+
+    case SHR_RDMAX_DELAY:
+      usec = (unsigned)va_arg(ap, unsigned);
+      if (set_wm(s, flag, usec) < 0) goto done;
+      break;
+
+    case SHR_WRROOM:
+      v = (size_t)va_arg(ap, size_t);
+      m = (size_t)va_arg(ap, size_t);
+      if (set_room(s, v, m) < 0) goto done;
+      break;
+
     default:
       shr_log("shr_ctl: unknown flag %d\n", flag);
       goto done;
@@ -3,6 +3,8 @@
 
 #include <sys/time.h> /* struct timeval (for stats) */
 #include <sys/uio.h>  /* struct iovec (for readv/writev) */
+#include <sys/types.h> /* pid_t (for client stats) */
+#include <stdint.h>    /* uint32_t (for packed read/write) */
 
 #if defined __cplusplus
 extern "C" {
@@ -22,6 +24,12 @@ extern "C" {
 struct shr;
 typedef struct shr shr;
 
+/* one message gathered from segments (shr_writemsg) */
+struct shr_msg {
+  struct iovec *iov;    /* the segments, copied in back to back */
+  size_t iovcnt;        /* number of segments */
+};
+
 /* stats structure */
 struct shr_stat {
 
@@ -36,6 +44,8 @@ struct shr_stat {
   /* this set of numbers describes the ring,
    * in terms of its size and unread content.
    * a reset has no bearing on these numbers. 
+   * bu and mu are sampled separately, so while
+   * i/o goes on they may briefly disagree.
    */
   size_t bn;            /* ring size in bytes */
   size_t bu;            /* current unread bytes (ready to read) in ring */
@@ -51,6 +61,16 @@ struct shr_stat {
 
   /* ring attributes */
   unsigned flags;
+  size_t ps;            /* page size the ring is mapped with */
+};
+
+/* per-client stats structure */
+struct shr_client {
+  pid_t pid;            /* process that has the ring open */
+  unsigned flags;       /* SHR_RDONLY or SHR_WRONLY */
+  size_t bw, br;        /* bytes written to/read from ring since open */
+  size_t mw, mr;        /* messages written to/read from ring since open */
+  size_t md, bd;        /* in drop mode: messages dropped/bytes dropped */
 };
 
 int shr_init(char *file, size_t sz, unsigned flags, ...);
@@ -59,11 +79,20 @@ int shr_get_selectable_fd(shr *s);
 ssize_t shr_read(shr *s, char *buf, size_t len);
 ssize_t shr_write(shr *s, char *buf, size_t len);
 ssize_t shr_readv(shr *s, char *buf, size_t len, struct iovec *iov, size_t *iovcnt);
+ssize_t shr_read_packed(shr *s, char *buf, size_t len, uint32_t *lens, size_t *n);
+ssize_t shr_read_peek(shr *s, struct iovec *iov, size_t *iovcnt);
+int shr_read_release(shr *s);
 ssize_t shr_writev(shr *s, struct iovec *iov, size_t iovcnt);
+ssize_t shr_write_packed(shr *s, char *buf, uint32_t *lens, size_t n);
+ssize_t shr_writemsg(shr *s, struct shr_msg *msgs, size_t n);
+ssize_t shr_write_reserve(shr *s, size_t len, struct iovec *iov);
+int shr_write_commit(shr *s);
+int shr_write_abort(shr *s);
 ssize_t shr_flush(struct shr *s, int wait);
 void shr_close(shr *s);
 int shr_appdata(shr *s, void **get, void *set, size_t *sz);
 int shr_stat(shr *s, struct shr_stat *stat, struct timeval *reset);
+int shr_stat_clients(shr *s, struct shr_client *c, size_t *nc);
 size_t shr_farm_stat(shr *s, int reset);
 int shr_ctl(shr *s, int flag, ...);
 
@@ -76,12 +105,26 @@ int shr_ctl(shr *s, int flag, ...);
 #define SHR_MAXMSGS_2    (1U << 4)  /* shr_init */
 #define SHR_SYNC         (1U << 5)  /* shr_init */
 #define SHR_MLOCK        (1U << 6)  /* shr_init */
+#define SHR_MUTEX        (1U << 7)  /* shr_init */
+#define SHR_SPSC         (1U << 8)  /* shr_init */
+#define SHR_MP           (1U << 9)  /* shr_init */
+#define SHR_FUTEX        (1U << 10) /* shr_init */
+#define SHR_MIRROR       (1U << 11) /* shr_init */
 #define SHR_OPEN_FENCE   (1U << 12) /* barrier between init and open flags */
 #define SHR_RDONLY       (1U << 13) /* shr_open */
 #define SHR_WRONLY       (1U << 14) /* shr_open */
 #define SHR_NONBLOCK     (1U << 15) /* shr_open */
 #define SHR_BUFFERED     (1U << 16) /* shr_open */
 #define SHR_POLLFD       (1U << 17) /* shr_ctl */
+#define SHR_SPIN         (1U << 18) /* shr_ctl */
+#define SHR_RDMIN_MSGS   (1U << 19) /* shr_ctl */
+#define SHR_RDMIN_BYTES  (1U << 20) /* shr_ctl */
+#define SHR_RDMAX_DELAY  (1U << 21) /* shr_ctl */
+#define SHR_WRROOM       (1U << 22) /* shr_ctl */
+#define SHR_HUGEPAGE     (1U << 23) /* shr_init (no room below the fence) */
+#define SHR_MONITOR      (1U << 24) /* shr_open */
+
+#define SHR_SPIN_MAX     1000000    /* max SHR_SPIN usec */
 
 #define SHR_APPDATA SHR_APPDATA_1 /* shr_init alias */
 #define SHR_MESSAGES     (0)      /* shr_init obsolete / always enabled */
@@ -0,0 +1,169 @@
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* one writer streams messages into a farm ring, while several
+ * farm readers read them all concurrently. the writer's rate
+ * is taken from its first message to its last; each reader's
+ * from the writer's start to when it has read the messages
+ * it could. it is run for 1, 2, 4, ... readers. the readers
+ * don't take the ring lock, so they shouldn't slow the writer
+ * or each other (given the cpus to run on).
+ */
+
+char *ring = "/dev/shm/perf-farm-readers.ring";
+
+#define NMSG 1000000
+#define RING_MSGS 100000
+#define MAX_READERS 64
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *prog;
+  int verbose;
+  unsigned max_readers;
+} CF = {
+  .max_readers = 16,
+};
+
+unsigned long usec(struct timeval *a, struct timeval *b) {
+  return (b->tv_sec - a->tv_sec) * 1000000 + (b->tv_usec - a->tv_usec);
+}
+
+int writer(int fd) {
+  unsigned long elp_us;
+  struct timeval a, b;
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  gettimeofday(&a, NULL);
+  for(n=0; n < NMSG; n++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) {
+      fprintf(stderr, "shr_write: error\n");
+      break;
+    }
+  }
+  gettimeofday(&b, NULL);
+
+  elp_us = usec(&a, &b);
+  if (write(fd, &elp_us, sizeof(elp_us)) != sizeof(elp_us)) return -1;
+  shr_close(s);
+  return 0;
+}
+
+/* read each message, or lose it to the writer; report those read */
+int reader(int fd) {
+  char buf[sizeof(msg) * 64];
+  struct iovec iov[64];
+  struct shr *s;
+  unsigned long n = 0;
+  size_t niov;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  while (n + shr_farm_stat(s, 0) < NMSG) {
+    niov = 64;
+    nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+    if (nr < 0) {
+      fprintf(stderr, "shr_readv: error\n");
+      break;
+    }
+    n += niov;
+  }
+
+  if (write(fd, &n, sizeof(n)) != sizeof(n)) return -1;
+  shr_close(s);
+  return 0;
+}
+
+int run(unsigned nr) {
+  pid_t wpid, rpid[MAX_READERS];
+  unsigned long elp_us, wr_us, n, tot = 0;
+  struct timeval a, b;
+  int pfd[2], wfd[2];
+  unsigned i;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * RING_MSGS, SHR_FARM|SHR_MAXMSGS_2,
+       (size_t)RING_MSGS) < 0) return -1;
+  if (pipe(pfd) < 0) return -1;
+  if (pipe(wfd) < 0) return -1;
+
+  for(i=0; i < nr; i++) {
+    rpid[i] = fork();
+    if (rpid[i] < 0) return -1;
+    if (rpid[i] == 0) exit(reader(pfd[1]));
+  }
+  usleep(100000); /* let the readers open the ring */
+
+  gettimeofday(&a, NULL);
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer(wfd[1]));
+  waitpid(wpid, NULL, 0);
+  if (read(wfd[0], &wr_us, sizeof(wr_us)) != sizeof(wr_us)) return -1;
+  for(i=0; i < nr; i++) waitpid(rpid[i], NULL, 0);
+  gettimeofday(&b, NULL);
+  for(i=0; i < nr; i++) {
+    if (read(pfd[0], &n, sizeof(n)) != sizeof(n)) return -1;
+    tot += n;
+  }
+  close(pfd[0]);
+  close(pfd[1]);
+  close(wfd[0]);
+  close(wfd[1]);
+
+  elp_us = usec(&a, &b);
+  printf("%2u readers: writer %.2f million msgs/sec, readers %.2f million "
+    "msgs/sec (%.0f%% read)\n", nr,
+    wr_us ? ((double)NMSG / wr_us) : 0,
+    elp_us ? ((double)tot / elp_us) : 0,
+    100.0 * tot / ((double)NMSG * nr));
+  if (CF.verbose) printf("%lu messages read in %lu usec\n", tot, elp_us);
+  return 0;
+}
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-r <max-readers>]\n", CF.prog);
+  fprintf(stderr,"-r <max-readers> (doubles from 1 up to this [def: 16])\n");
+  fprintf(stderr,"-v verbose\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  int rc = -1, opt;
+  unsigned nr;
+
+  CF.prog = argv[0];
+  setlinebuf(stdout);
+
+  while ( (opt = getopt(argc,argv,"vhr:")) > 0) {
+    switch(opt) {
+      case 'v': CF.verbose++; break;
+      case 'r': CF.max_readers = atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+
+  if (CF.max_readers > MAX_READERS) usage();
+
+  for(nr = 1; nr <= CF.max_readers; nr *= 2) {
+    if (run(nr) < 0) goto done;
+  }
+
+  rc = 0;
+
+done:
+  unlink(ring);
+  return rc;
+}
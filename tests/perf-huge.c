@@ -0,0 +1,177 @@
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* huge page benchmark. one writer and one reader stream messages
+ * through a large SHR_SPSC ring, in batches, so that the copies
+ * sweep across many pages: first in a ring of small pages, then in
+ * SHR_HUGEPAGE mode on the same file system (tmpfs, so transparent
+ * huge pages, if the mount or shmem_enabled allows them), and last
+ * in a ring on hugetlbfs, if one is given (-d). the rate is taken
+ * at the reader from its first batch to its last.
+ */
+
+#define RING_SZ (256 * 1024 * 1024)
+#define MSG_SZ 1024
+#define BATCH 64
+
+struct {
+  char *prog;
+  int verbose;
+  char *shm;
+  char *hugetlbfs;
+  size_t nmsg;
+  char ring[256];
+} CF = {
+  .shm = "/dev/shm",
+  .nmsg = 4000000,
+};
+
+unsigned long usec(struct timeval *a, struct timeval *b) {
+  return (b->tv_sec - a->tv_sec) * 1000000 + (b->tv_usec - a->tv_usec);
+}
+
+/* sum of the huge page mappings of shared memory in this process */
+void show_pmd(void) {
+  char line[256];
+  FILE *f;
+
+  f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL) return;
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, "ShmemPmdMapped:", 15) ||
+        !strncmp(line, "FilePmdMapped:", 14)) printf("  %s", line);
+  }
+  fclose(f);
+}
+
+int writer(void) {
+  struct iovec iov[BATCH];
+  char msg[MSG_SZ];
+  struct shr *s;
+  size_t n;
+  int i;
+
+  s = shr_open(CF.ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  memset(msg, 'x', sizeof(msg));
+  for(i=0; i < BATCH; i++) {
+    iov[i].iov_base = msg;
+    iov[i].iov_len = sizeof(msg);
+  }
+
+  for(n=0; n < CF.nmsg; n += BATCH) {
+    if (shr_writev(s, iov, BATCH) != sizeof(msg) * BATCH) {
+      fprintf(stderr, "shr_writev: error\n");
+      break;
+    }
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int reader(char *name) {
+  char buf[MSG_SZ * BATCH];
+  struct iovec iov[BATCH];
+  unsigned long elp_us;
+  struct timeval a, b;
+  struct shr_stat st;
+  struct shr *s;
+  size_t n, niov;
+  ssize_t nr;
+
+  s = shr_open(CF.ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+  if (shr_stat(s, &st, NULL) < 0) return -1;
+
+  for(n=0; n < CF.nmsg; n += niov) {
+    niov = BATCH;
+    nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+    if (nr <= 0) {
+      fprintf(stderr, "shr_readv: error\n");
+      break;
+    }
+    if (n == 0) gettimeofday(&a, NULL);
+  }
+  gettimeofday(&b, NULL);
+
+  elp_us = usec(&a, &b);
+  printf("%s (page size %zu): %.2f million msgs/sec, %.2f GB/sec\n",
+    name, st.ps, elp_us ? ((double)n / elp_us) : 0,
+    elp_us ? ((double)n * MSG_SZ / elp_us / 1000) : 0);
+  if (CF.verbose) {
+    printf("  %zu messages in %lu usec, ring size %zu\n", n, elp_us, st.bn);
+    show_pmd();
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, char *dir, unsigned flags) {
+  pid_t rpid, wpid;
+
+  snprintf(CF.ring, sizeof(CF.ring), "%s/perf-huge.ring", dir);
+  unlink(CF.ring);
+  if (shr_init(CF.ring, RING_SZ, flags|SHR_MAXMSGS_2,
+       (size_t)(RING_SZ / MSG_SZ)) < 0) return -1;
+
+  rpid = fork();
+  if (rpid < 0) return -1;
+  if (rpid == 0) exit(reader(name));
+
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer());
+
+  waitpid(wpid,NULL,0);
+  waitpid(rpid,NULL,0);
+  unlink(CF.ring);
+  return 0;
+}
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-n <count>] [-s <dir>] [-d <dir>]\n",
+    CF.prog);
+  fprintf(stderr,"-n <count> messages to stream [def: 4000000]\n");
+  fprintf(stderr,"-s <dir>   tmpfs directory [def: /dev/shm]\n");
+  fprintf(stderr,"-d <dir>   hugetlbfs directory [def: none]\n");
+  fprintf(stderr,"-v verbose\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  int rc = -1, opt;
+
+  CF.prog = argv[0];
+  setlinebuf(stdout);
+
+  while ( (opt = getopt(argc,argv,"vhn:s:d:")) > 0) {
+    switch(opt) {
+      case 'v': CF.verbose++; break;
+      case 'n': CF.nmsg = atol(optarg); break;
+      case 's': CF.shm = strdup(optarg); break;
+      case 'd': CF.hugetlbfs = strdup(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+  if (CF.nmsg == 0) usage();
+
+  if (run("small pages", CF.shm, SHR_SPSC) < 0) goto done;
+  if (run("THP        ", CF.shm, SHR_SPSC|SHR_HUGEPAGE) < 0) goto done;
+  if (CF.hugetlbfs &&
+      (run("hugetlbfs  ", CF.hugetlbfs, SHR_SPSC|SHR_HUGEPAGE) < 0))
+    goto done;
+
+  rc = 0;
+
+done:
+  return rc;
+}
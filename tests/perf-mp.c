@@ -0,0 +1,146 @@
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* several writers stream messages into one ring concurrently,
+ * while a reader drains it. the aggregate rate is taken from
+ * the start of the writers to the end of the last. it is run
+ * for 1, 2, 4, ... writers, on a ring with the usual lock on
+ * the writer side (SHR_MUTEX), and on a SHR_MP ring.
+ */
+
+char *ring = "/dev/shm/perf-mp.ring";
+
+#define NMSG 1000000 /* total, divided among writers */
+#define RING_MSGS 100000
+#define MAX_WRITERS 64
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *prog;
+  int verbose;
+  unsigned max_writers;
+} CF = {
+  .max_writers = 16,
+};
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_MP   ", SHR_MP},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+int writer(unsigned nmsg) {
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(n=0; n < nmsg; n++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) {
+      fprintf(stderr, "shr_write: error\n");
+      break;
+    }
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int reader(unsigned nmsg) {
+  char buf[sizeof(msg)];
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  for(n=0; n < nmsg; n++) {
+    if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) {
+      fprintf(stderr, "shr_read: error\n");
+      break;
+    }
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags, unsigned nw) {
+  unsigned long elp_us;
+  struct timeval a, b;
+  pid_t rpid, wpid[MAX_WRITERS];
+  unsigned w, per;
+
+  per = NMSG / nw;
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * RING_MSGS, flags|SHR_MAXMSGS_2,
+       (size_t)RING_MSGS) < 0) return -1;
+
+  rpid = fork();
+  if (rpid < 0) return -1;
+  if (rpid == 0) exit(reader(per * nw));
+
+  gettimeofday(&a, NULL);
+  for(w=0; w < nw; w++) {
+    wpid[w] = fork();
+    if (wpid[w] < 0) return -1;
+    if (wpid[w] == 0) exit(writer(per));
+  }
+  for(w=0; w < nw; w++) waitpid(wpid[w], NULL, 0);
+  gettimeofday(&b, NULL);
+  waitpid(rpid, NULL, 0);
+
+  elp_us = (b.tv_sec - a.tv_sec) * 1000000 + (b.tv_usec - a.tv_usec);
+  printf("%s %2u writers: %.2f million msgs/sec\n", name, nw,
+    elp_us ? ((double)per * nw / elp_us) : 0);
+  if (CF.verbose) printf("%u messages in %lu usec\n", per * nw, elp_us);
+  return 0;
+}
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-w <max-writers>]\n", CF.prog);
+  fprintf(stderr,"-w <max-writers> (doubles from 1 up to this [def: 16])\n");
+  fprintf(stderr,"-v verbose\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  int rc = -1, opt;
+  unsigned i, nw;
+
+  CF.prog = argv[0];
+  setlinebuf(stdout);
+
+  while ( (opt = getopt(argc,argv,"vhw:")) > 0) {
+    switch(opt) {
+      case 'v': CF.verbose++; break;
+      case 'w': CF.max_writers = atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+
+  if (CF.max_writers > MAX_WRITERS) usage();
+
+  for(i=0; i < adim(modes); i++) {
+    for(nw = 1; nw <= CF.max_writers; nw *= 2) {
+      if (run(modes[i].name, modes[i].flags, nw) < 0) goto done;
+    }
+  }
+
+  rc = 0;
+
+done:
+  unlink(ring);
+  return rc;
+}
@@ -0,0 +1,137 @@
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* one writer and one reader stream messages through a ring
+ * concurrently. the ring holds a fraction of the messages, so
+ * the two run side by side. the rate is taken at the reader
+ * from its first message to its last. the same run is done on
+ * a file locked ring, a SHR_MUTEX ring, and a SHR_SPSC ring.
+ * with -S, the writer and reader spin before blocking. with -F,
+ * they block on futexes (SHR_FUTEX) rather than the bw sockets.
+ */
+
+char *ring = "/dev/shm/perf-spsc.ring";
+
+#define NMSG 1000000
+#define RING_MSGS 10000
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *prog;
+  int verbose;
+  unsigned spin;
+  unsigned futex;
+} CF;
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC ", SHR_SPSC},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+int writer(void) {
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+  if (CF.spin && (shr_ctl(s, SHR_SPIN, CF.spin) < 0)) return -1;
+
+  for(n=0; n < NMSG; n++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) {
+      fprintf(stderr, "shr_write: error\n");
+      break;
+    }
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int reader(char *name) {
+  unsigned long elp_us;
+  struct timeval a, b;
+  char buf[sizeof(msg)];
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+  if (CF.spin && (shr_ctl(s, SHR_SPIN, CF.spin) < 0)) return -1;
+
+  for(n=0; n < NMSG; n++) {
+    if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) {
+      fprintf(stderr, "shr_read: error\n");
+      break;
+    }
+    if (n == 0) gettimeofday(&a, NULL);
+  }
+  gettimeofday(&b, NULL);
+
+  elp_us = (b.tv_sec - a.tv_sec) * 1000000 + (b.tv_usec - a.tv_usec);
+  printf("%s: %.2f million msgs/sec\n", name,
+    elp_us ? ((double)n / elp_us) : 0);
+  if (CF.verbose) printf("%u messages in %lu usec\n", n, elp_us);
+
+  shr_close(s);
+  return 0;
+}
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-F] [-S <usec>]\n", CF.prog);
+  fprintf(stderr,"-F block on futexes (SHR_FUTEX)\n");
+  fprintf(stderr,"-S <usec> spin up to usec before blocking (SHR_SPIN)\n");
+  fprintf(stderr,"-v verbose\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  int rc = -1, opt;
+  pid_t rpid,wpid;
+  unsigned i;
+
+  CF.prog = argv[0];
+
+  while ( (opt = getopt(argc,argv,"vhFS:")) > 0) {
+    switch(opt) {
+      case 'v': CF.verbose++; break;
+      case 'F': CF.futex = SHR_FUTEX; break;
+      case 'S': CF.spin = atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+
+  for(i=0; i < adim(modes); i++) {
+    unlink(ring);
+    if (shr_init(ring, sizeof(msg) * RING_MSGS,
+         modes[i].flags|CF.futex|SHR_MAXMSGS_2, (size_t)RING_MSGS) < 0) goto done;
+
+    rpid = fork();
+    if (rpid < 0) goto done;
+    if (rpid == 0) exit(reader(modes[i].name));
+
+    wpid = fork();
+    if (wpid < 0) goto done;
+    if (wpid == 0) exit(writer());
+
+    waitpid(wpid,NULL,0);
+    waitpid(rpid,NULL,0);
+  }
+
+  rc = 0;
+
+done:
+  unlink(ring);
+  return rc;
+}
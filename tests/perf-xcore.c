@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* cross-core benchmarks. the writer and the reader are pinned
+ * to different cpus (-w, -r) so that every line they share
+ * moves between cores.
+ *
+ * first, two processes each increment their own counter in a
+ * shared mapping, with the counters adjacent (one cache line)
+ * or a line apart. the difference is the cost of false sharing,
+ * which the ring's control region layout avoids.
+ *
+ * then one writer and one reader stream messages through a ring
+ * in each lock mode, as in perf-spsc, but pinned. the rate is
+ * taken at the reader from its first message to its last.
+ */
+
+char *ring = "/dev/shm/perf-xcore.ring";
+
+#define NMSG 1000000
+#define RING_MSGS 10000
+#define NINC 100000000
+#define LINE_SZ 128
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *prog;
+  int verbose;
+  int wcpu;
+  int rcpu;
+} CF = {
+  .wcpu = 0,
+  .rcpu = 1,
+};
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC ", SHR_SPSC},
+  {"SHR_MP   ", SHR_MP},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+void pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+    fprintf(stderr, "warning: can't pin to cpu %d\n", cpu);
+}
+
+unsigned long usec(struct timeval *a, struct timeval *b) {
+  return (b->tv_sec - a->tv_sec) * 1000000 + (b->tv_usec - a->tv_usec);
+}
+
+/* two counters, adjacent or a cache line apart, each
+ * incremented by its own process on its own cpu */
+int counters(char *name, size_t gap) {
+  struct timeval a, b;
+  size_t volatile *c;
+  pid_t pid[2];
+  char *map;
+  int k;
+  long n;
+
+  map = mmap(NULL, 2 * LINE_SZ, PROT_READ|PROT_WRITE,
+             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) return -1;
+
+  gettimeofday(&a, NULL);
+  for(k=0; k < 2; k++) {
+    pid[k] = fork();
+    if (pid[k] < 0) return -1;
+    if (pid[k] == 0) {
+      pin(k ? CF.rcpu : CF.wcpu);
+      c = (size_t volatile*)(map + k * gap);
+      for(n=0; n < NINC; n++) (*c)++;
+      exit(0);
+    }
+  }
+  for(k=0; k < 2; k++) waitpid(pid[k], NULL, 0);
+  gettimeofday(&b, NULL);
+
+  printf("%s: %.2f million increments/sec\n", name,
+    2.0 * NINC / usec(&a, &b));
+  munmap(map, 2 * LINE_SZ);
+  return 0;
+}
+
+int writer(void) {
+  struct shr *s;
+  unsigned n;
+
+  pin(CF.wcpu);
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(n=0; n < NMSG; n++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) {
+      fprintf(stderr, "shr_write: error\n");
+      break;
+    }
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int reader(char *name) {
+  unsigned long elp_us;
+  struct timeval a, b;
+  char buf[sizeof(msg)];
+  struct shr *s;
+  unsigned n;
+
+  pin(CF.rcpu);
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  for(n=0; n < NMSG; n++) {
+    if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) {
+      fprintf(stderr, "shr_read: error\n");
+      break;
+    }
+    if (n == 0) gettimeofday(&a, NULL);
+  }
+  gettimeofday(&b, NULL);
+
+  elp_us = usec(&a, &b);
+  printf("%s: %.2f million msgs/sec\n", name,
+    elp_us ? ((double)n / elp_us) : 0);
+  if (CF.verbose) printf("%u messages in %lu usec\n", n, elp_us);
+
+  shr_close(s);
+  return 0;
+}
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-w <cpu>] [-r <cpu>]\n", CF.prog);
+  fprintf(stderr,"-w <cpu> pin writer to cpu [def: 0]\n");
+  fprintf(stderr,"-r <cpu> pin reader to cpu [def: 1]\n");
+  fprintf(stderr,"-v verbose\n");
+  exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+  int rc = -1, opt;
+  pid_t rpid,wpid;
+  unsigned i;
+
+  CF.prog = argv[0];
+  setlinebuf(stdout);
+
+  while ( (opt = getopt(argc,argv,"vhw:r:")) > 0) {
+    switch(opt) {
+      case 'v': CF.verbose++; break;
+      case 'w': CF.wcpu = atoi(optarg); break;
+      case 'r': CF.rcpu = atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+
+  printf("writer on cpu %d, reader on cpu %d\n", CF.wcpu, CF.rcpu);
+  if (counters("counters, same line   ", sizeof(size_t)) < 0) goto done;
+  if (counters("counters, lines apart ", LINE_SZ) < 0) goto done;
+
+  for(i=0; i < adim(modes); i++) {
+    unlink(ring);
+    if (shr_init(ring, sizeof(msg) * RING_MSGS,
+         modes[i].flags|SHR_MAXMSGS_2, (size_t)RING_MSGS) < 0) goto done;
+
+    rpid = fork();
+    if (rpid < 0) goto done;
+    if (rpid == 0) exit(reader(modes[i].name));
+
+    wpid = fork();
+    if (wpid < 0) goto done;
+    if (wpid == 0) exit(writer());
+
+    waitpid(wpid,NULL,0);
+    waitpid(rpid,NULL,0);
+  }
+
+  rc = 0;
+
+done:
+  unlink(ring);
+  return rc;
+}
@@ -36,6 +36,7 @@ struct {
   time_t start;
   int verbose;
   int speed;
+  unsigned flags;
   char s[100];
 } CF = {
   .speed = 1,
@@ -87,7 +88,7 @@ char *rate(ssize_t byte, int nmsg, struct timeval *beg, struct timeval *end) {
   elp_us = end_us - beg_us;
 
   /* convert msgs-per-microsecond to millions-of-messages-per-second */
-  mmsgs_s = elp_us ? (nmsg / elp_us) : 0;
+  mmsgs_s = elp_us ? ((double)nmsg / elp_us) : 0;
 
   /* convert bytes-per-microsecond to megabytes-per-second */
   mbyte_s = elp_us ? (byte * 1000000.0 / (1024.0 * 1024.0) / elp_us) : 0;
@@ -97,7 +98,7 @@ char *rate(ssize_t byte, int nmsg, struct timeval *beg, struct timeval *end) {
     printf("%.2f mb/s\n", mbyte_s);
   }
 
-  snprintf(CF.s, sizeof(CF.s), "%u million msgs/sec", (int)mmsgs_s);
+  snprintf(CF.s, sizeof(CF.s), "%.2f million msgs/sec", mmsgs_s);
   return CF.s;
 }
 
@@ -186,8 +187,9 @@ void execute(int me) {
 }
 
 void usage() {
-  fprintf(stderr,"usage: %s [-v] [-s <slowdown>]\n", CF.prog);
+  fprintf(stderr,"usage: %s [-v] [-x] [-s <slowdown>]\n", CF.prog);
   fprintf(stderr,"-s <slowdown> (factor to slow test [def: 1])\n");
+  fprintf(stderr,"-x use mutex ring lock (SHR_MUTEX)\n");
   fprintf(stderr,"-v verbose\n");
   exit(-1);
 }
@@ -197,9 +199,10 @@ int main(int argc, char *argv[]) {
   pid_t rpid,wpid;
   uid_t uid;
 
-  while ( (opt = getopt(argc,argv,"vhs:")) > 0) {
+  while ( (opt = getopt(argc,argv,"vhxs:")) > 0) {
     switch(opt) {
       case 'v': CF.verbose++; break;
+      case 'x': CF.flags |= SHR_MUTEX; break;
       case 's': CF.speed = atoi(optarg); break;
       case 'h': default: usage(); break;
     }
@@ -210,7 +213,7 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "warning: run as root to raise memory locking limits\n");
 
   time(&CF.start);
-  shr_init(ring, ring_sz, SHR_MLOCK|SHR_MAXMSGS_2, NMSG);
+  shr_init(ring, ring_sz, CF.flags|SHR_MLOCK|SHR_MAXMSGS_2, NMSG);
 
   rpid = fork();
   if (rpid < 0) goto done;
@@ -0,0 +1,101 @@
+#include <sys/wait.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "shr.h"
+
+char *ring =  __FILE__ ".ring";
+
+int main() {
+  setlinebuf(stdout);
+  struct shr *w = NULL, *w2 = NULL, *r = NULL, *r2 = NULL;
+  struct iovec iov[2];
+  char out[10];
+  pid_t pid;
+  ssize_t nr;
+  int rc = -1;
+
+  unlink(ring);
+
+  /* a single reader owns the read position */
+  if (shr_init(ring, 1024, SHR_SPSC|SHR_DROP) == 0) goto done;
+  if (shr_init(ring, 1024, SHR_SPSC|SHR_FARM) == 0) goto done;
+  printf("init spsc|drop, spsc|farm refused\n");
+
+  if (shr_init(ring, 1024, SHR_SPSC) < 0) goto done;
+  printf("init spsc\n");
+
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) goto done;
+  printf("open writer\n");
+
+  w2 = shr_open(ring, SHR_WRONLY);
+  printf("open second writer: %s\n", w2 ? "ok" : "refused");
+  if (w2) goto done;
+
+  r = shr_open(ring, SHR_RDONLY|SHR_NONBLOCK);
+  if (r == NULL) goto done;
+  printf("open reader\n");
+
+  r2 = shr_open(ring, SHR_RDONLY);
+  printf("open second reader: %s\n", r2 ? "ok" : "refused");
+  if (r2) goto done;
+
+  nr = shr_read(r, out, sizeof(out));
+  printf("read empty: %zd\n", nr);
+
+  nr = shr_write(w, "hello", 5);
+  printf("write: %zd\n", nr);
+  nr = shr_write(w, "world", 5);
+  printf("write: %zd\n", nr);
+
+  nr = shr_read(r, out, sizeof(out));
+  if (nr > 0) printf("read: %.*s\n", (int)nr, out);
+  nr = shr_read(r, out, sizeof(out));
+  if (nr > 0) printf("read: %.*s\n", (int)nr, out);
+  nr = shr_read(r, out, sizeof(out));
+  printf("read empty: %zd\n", nr);
+
+  /* the writer role is released on close */
+  shr_close(w);
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) goto done;
+  printf("reopen writer\n");
+
+  nr = shr_write(w, "again", 5);
+  printf("write: %zd\n", nr);
+  nr = shr_read(r, out, sizeof(out));
+  if (nr > 0) printf("read: %.*s\n", (int)nr, out);
+
+  /* a writer that dies mid-write leaves its role, and
+   * nothing of its message, to the next */
+  shr_close(w);
+  w = NULL;
+  pid = fork();
+  if (pid < 0) goto done;
+  if (pid == 0) {
+    w = shr_open(ring, SHR_WRONLY);
+    if (w == NULL) _exit(1);
+    if (shr_write_reserve(w, 5, iov) != 5) _exit(1);
+    memcpy(iov[0].iov_base, "dead!", 5);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) goto done;
+  printf("writer died, reopen writer\n");
+  nr = shr_write(w, "alive", 5);
+  printf("write: %zd\n", nr);
+  nr = shr_read(r, out, sizeof(out));
+  if (nr > 0) printf("read: %.*s\n", (int)nr, out);
+  nr = shr_read(r, out, sizeof(out));
+  printf("read empty: %zd\n", nr);
+
+  rc = 0;
+
+ done:
+  if (w) shr_close(w);
+  if (r) shr_close(r);
+  unlink(ring);
+  return rc;
+}
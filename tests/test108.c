@@ -0,0 +1,185 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* SHR_MP: several writers stream into a small ring at once,
+ * reserving space without the ring lock. each message has
+ * the writer number, a per-writer sequence number, and a
+ * length and content derived from those. the reader checks
+ * that each writer's messages arrive whole and in order.
+ * then non-blocking writers fill a ring with room for all
+ * their messages; none is refused for another holding the
+ * reservation point.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NWRITERS 8
+#define NMSG 20000
+#define MAXLEN 64
+#define NB_NMSG 2000
+
+struct hdr {
+  unsigned w;
+  unsigned seq;
+};
+
+size_t fill(char *buf, unsigned w, unsigned seq) {
+  struct hdr h = { .w = w, .seq = seq };
+  size_t i, len = sizeof(h) + ((w + seq) % (MAXLEN - sizeof(h)));
+  memcpy(buf, &h, sizeof(h));
+  for(i = sizeof(h); i < len; i++) buf[i] = (char)(w + seq + i);
+  return len;
+}
+
+int writer(unsigned w) {
+  char bufs[3][MAXLEN];
+  struct iovec iov[3];
+  unsigned seq = 0, n;
+  struct shr *s;
+  size_t len;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+
+  while (seq < NMSG) {
+    if ((seq % 7 == 0) && (seq + 3 <= NMSG)) {
+      /* a batch of writes */
+      for(n = 0; n < 3; n++) {
+        iov[n].iov_base = bufs[n];
+        iov[n].iov_len = fill(bufs[n], w, seq++);
+      }
+      if (shr_writev(s, iov, 3) <= 0) goto done;
+      continue;
+    }
+    len = fill(bufs[0], w, seq++);
+    if (shr_write(s, bufs[0], len) != (ssize_t)len) goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+/* every write fits; none may come back 0 */
+int nb_writer(unsigned w) {
+  char buf[MAXLEN];
+  struct shr *s;
+  unsigned seq;
+  size_t len;
+
+  s = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK);
+  if (s == NULL) return -1;
+  for(seq = 0; seq < NB_NMSG; seq++) {
+    len = fill(buf, w, seq);
+    if (shr_write(s, buf, len) != (ssize_t)len) return -1;
+  }
+  shr_close(s);
+  return 0;
+}
+
+int reader(void) {
+  unsigned next[NWRITERS] = {0}, n;
+  char buf[MAXLEN], exp[MAXLEN];
+  struct shr *s;
+  struct hdr h;
+  size_t len;
+  ssize_t nr;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) goto done;
+
+  for(n = 0; n < NWRITERS * NMSG; n++) {
+    nr = shr_read(s, buf, sizeof(buf));
+    if (nr < (ssize_t)sizeof(h)) {
+      printf("reader: read %zd\n", nr);
+      goto done;
+    }
+    memcpy(&h, buf, sizeof(h));
+    if ((h.w >= NWRITERS) || (h.seq != next[h.w])) {
+      printf("reader: out of order message %u/%u\n", h.w, h.seq);
+      goto done;
+    }
+    len = fill(exp, h.w, h.seq);
+    if ((nr != (ssize_t)len) || memcmp(buf, exp, len)) {
+      printf("reader: bad message %u/%u\n", h.w, h.seq);
+      goto done;
+    }
+    next[h.w]++;
+  }
+
+  printf("reader: %u messages, in order per writer\n", n);
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int main() {
+  setlinebuf(stdout);
+  struct shr_stat stat;
+  pid_t rpid, wpid[NWRITERS];
+  int rc = -1, st, ok = 1;
+  struct shr *s;
+  unsigned w;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, SHR_MP|SHR_DROP) == 0) goto done;
+  if (shr_init(ring, 1024, SHR_MP|SHR_SPSC) == 0) goto done;
+  printf("init mp|drop, mp|spsc refused\n");
+
+  if (shr_init(ring, 2048, SHR_MP|SHR_MAXMSGS_2, (size_t)64) < 0) goto done;
+
+  rpid = fork();
+  if (rpid < 0) goto done;
+  if (rpid == 0) exit(reader() ? 1 : 0);
+
+  for(w = 0; w < NWRITERS; w++) {
+    wpid[w] = fork();
+    if (wpid[w] < 0) goto done;
+    if (wpid[w] == 0) exit(writer(w) ? 1 : 0);
+  }
+
+  for(w = 0; w < NWRITERS; w++) {
+    waitpid(wpid[w], &st, 0);
+    if (!WIFEXITED(st) || WEXITSTATUS(st)) ok = 0;
+  }
+  waitpid(rpid, &st, 0);
+  printf("writers: %s\n", ok ? "ok" : "failed");
+  printf("reader: %s\n", (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed");
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) goto done;
+  if (shr_stat(s, &stat, NULL) < 0) goto done;
+  printf("mw %zu mr %zu bu %zu mu %zu mp %s\n", stat.mw, stat.mr, stat.bu,
+    stat.mu, (stat.flags & SHR_MP) ? "yes" : "no");
+  shr_close(s);
+
+  if (shr_init(ring, NWRITERS * NB_NMSG * MAXLEN, SHR_MP|SHR_MAXMSGS_2,
+               (size_t)(NWRITERS * NB_NMSG)) < 0) goto done;
+  for(w = 0; w < NWRITERS; w++) {
+    wpid[w] = fork();
+    if (wpid[w] < 0) goto done;
+    if (wpid[w] == 0) exit(nb_writer(w) ? 1 : 0);
+  }
+  for(ok = 1, w = 0; w < NWRITERS; w++) {
+    waitpid(wpid[w], &st, 0);
+    if (!WIFEXITED(st) || WEXITSTATUS(st)) ok = 0;
+  }
+  printf("non-blocking writers: %s\n", ok ? "all written" : "refused");
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
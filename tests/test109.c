@@ -0,0 +1,182 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include "shr.h"
+
+/* writers and readers copy messages in and out of the ring
+ * without the ring lock, having reserved or claimed them
+ * under it. several writers and readers run at once, with
+ * messages large enough for the copies to overlap. each
+ * message has a header (writer, sequence number) and a body
+ * derived from it; the readers check every message is whole.
+ *
+ * first a regular ring, with two readers splitting the
+ * messages between them. then a farm ring, where writers
+ * overwrite messages that farm readers may be copying;
+ * they must discard those rather than return them torn.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NWRITERS 4
+#define NREADERS 2
+#define NMSG 2000
+#define MAXLEN (64*1024)
+
+struct hdr {
+  unsigned w;
+  unsigned seq;
+};
+
+size_t fill(char *buf, unsigned w, unsigned seq) {
+  struct hdr h = { .w = w, .seq = seq };
+  size_t i, len = sizeof(h) + ((w * 7919 + seq * 104729) % (MAXLEN - sizeof(h)));
+  memcpy(buf, &h, sizeof(h));
+  for(i = sizeof(h); i < len; i++) buf[i] = (char)(w + seq + i);
+  return len;
+}
+
+int check(char *buf, size_t len) {
+  char exp[MAXLEN];
+  struct hdr h;
+
+  if (len < sizeof(h)) return -1;
+  memcpy(&h, buf, sizeof(h));
+  if (h.w >= NWRITERS) return -1;
+  if (len != fill(exp, h.w, h.seq)) return -1;
+  return memcmp(buf, exp, len) ? -1 : 0;
+}
+
+int writer(unsigned w) {
+  char buf[MAXLEN];
+  struct shr *s;
+  unsigned seq;
+  size_t len;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+
+  for(seq = 0; seq < NMSG; seq++) {
+    len = fill(buf, w, seq);
+    if (shr_write(s, buf, len) != (ssize_t)len) goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+/* read until the writers are done (the
+ * pipe at fd hits eof) and the ring is empty */
+int reader(int fd, int cfd) {
+  char buf[MAXLEN * 4];
+  struct iovec iov[4];
+  size_t n = 0, k, niov;
+  int rc = -1, done = 0;
+  struct shr *s;
+  ssize_t nr;
+  char c;
+
+  s = shr_open(ring, SHR_RDONLY|SHR_NONBLOCK);
+  if (s == NULL) goto done;
+
+  while (1) {
+    niov = 4;
+    nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+    if (nr < 0) goto done;
+    if (nr == 0) {
+      if (done) break;
+      if (read(fd, &c, 1) == 0) done = 1; /* look once more */
+      else usleep(1000);
+      continue;
+    }
+    for(k = 0; k < niov; k++) {
+      if (check(iov[k].iov_base, iov[k].iov_len) < 0) {
+        printf("reader: torn message\n");
+        goto done;
+      }
+      n++;
+    }
+  }
+
+  /* report the count */
+  if (write(cfd, &n, sizeof(n)) != sizeof(n)) goto done;
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int run(unsigned flags, int farm) {
+  pid_t rpid[NREADERS], wpid[NWRITERS];
+  int fd[2], cfd[2], rc = -1, st, ok = 1;
+  size_t n, total = 0;
+  unsigned w, i;
+
+  unlink(ring);
+  if (shr_init(ring, 4 * MAXLEN, flags) < 0) goto done;
+  if ((pipe(fd) < 0) || (pipe(cfd) < 0)) goto done;
+  if (fcntl(fd[0], F_SETFL, O_NONBLOCK) < 0) goto done;
+
+  for(i = 0; i < NREADERS; i++) {
+    rpid[i] = fork();
+    if (rpid[i] < 0) goto done;
+    if (rpid[i] == 0) {
+      close(fd[1]);
+      exit(reader(fd[0], cfd[1]) ? 1 : 0);
+    }
+  }
+
+  for(w = 0; w < NWRITERS; w++) {
+    wpid[w] = fork();
+    if (wpid[w] < 0) goto done;
+    if (wpid[w] == 0) exit(writer(w) ? 1 : 0);
+  }
+
+  for(w = 0; w < NWRITERS; w++) {
+    waitpid(wpid[w], &st, 0);
+    if (!WIFEXITED(st) || WEXITSTATUS(st)) ok = 0;
+  }
+  close(fd[1]);  /* readers see eof */
+
+  for(i = 0; i < NREADERS; i++) {
+    waitpid(rpid[i], &st, 0);
+    if (!WIFEXITED(st) || WEXITSTATUS(st)) ok = 0;
+    if (read(cfd[0], &n, sizeof(n)) == sizeof(n)) total += n;
+  }
+
+  /* farm readers each see the messages not overwritten */
+  printf("%s: %s", farm ? "farm" : "regular", ok ? "ok" : "failed");
+  if (!farm) printf(", %zu messages read", total);
+  printf("\n");
+  close(fd[0]);
+  close(cfd[0]);
+  close(cfd[1]);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  return rc;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run(0, 0) < 0) goto done;
+  if (run(SHR_MUTEX, 0) < 0) goto done;
+  if (run(SHR_FARM, 1) < 0) goto done;
+  rc = 0;
+
+ done:
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,171 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include "shr.h"
+
+/* farm readers read without the ring lock. one writer streams
+ * numbered messages into a small farm ring, while several
+ * readers read it at once, and fall behind. each reader checks
+ * that the messages it gets are whole and in order, and that
+ * those it read plus those it lost (shr_farm_stat) account
+ * for every message written. then again on a ring of a few
+ * slots, where the writer reclaims slots under the readers
+ * all the time, rather than space.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NREADERS 8
+#define NMSG 100000
+#define MAXLEN 256
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(void) {
+  char buf[MAXLEN];
+  struct shr *s;
+  unsigned seq;
+  size_t len;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+
+  for(seq = 0; seq < NMSG; seq++) {
+    len = fill(buf, seq);
+    if (shr_write(s, buf, len) != (ssize_t)len) goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+/* read until the writer is done (the pipe at
+ * fd hits eof) and the ring is empty. rfd
+ * signals the reader has opened the ring */
+int reader(int fd, int rfd) {
+  char buf[MAXLEN * 8], exp[MAXLEN];
+  unsigned seq, next = 0, nread = 0;
+  size_t lost, k, niov;
+  struct iovec iov[8];
+  int rc = -1, eof = 0;
+  struct shr *s;
+  ssize_t nr;
+  char c;
+
+  s = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (s == NULL) goto done;
+  if (write(rfd, "r", 1) != 1) goto done;
+
+  while (1) {
+    niov = 8;
+    nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+    if (nr < 0) goto done;
+    if (nr == 0) {
+      if (eof) break;
+      /* look once more after eof */
+      if (read(fd, &c, 1) == 0) eof = 1;
+      else usleep(10);
+      continue;
+    }
+    for(k = 0; k < niov; k++) {
+      memcpy(&seq, iov[k].iov_base, sizeof(seq));
+      if ((seq < next) || (iov[k].iov_len != fill(exp, seq)) ||
+          memcmp(iov[k].iov_base, exp, iov[k].iov_len)) {
+        printf("reader: bad message\n");
+        goto done;
+      }
+      next = seq + 1;
+      nread++;
+    }
+  }
+
+  lost = shr_farm_stat(s, 0);
+  if (nread + lost != NMSG) {
+    printf("reader: read %u, lost %zu, of %u\n", nread, lost, NMSG);
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+/* nslots, if non-zero, limits the ring to that many messages */
+int run(char *name, unsigned nreaders, size_t nslots) {
+  pid_t wpid, rpid[NREADERS];
+  int pfd[2], rfd[2], ws, rs, rc = -1;
+  unsigned i, ok = 0;
+  char c;
+
+  unlink(ring);
+  if (nslots) {
+    if (shr_init(ring, 64 * MAXLEN, SHR_FARM|SHR_MAXMSGS_2, nslots) < 0)
+      goto done;
+  } else if (shr_init(ring, 64 * MAXLEN, SHR_FARM) < 0) goto done;
+  if (pipe(pfd) < 0) goto done;
+  if (pipe(rfd) < 0) goto done;
+  if (fcntl(pfd[0], F_SETFL, O_NONBLOCK) < 0) goto done;
+
+  for(i = 0; i < nreaders; i++) {
+    rpid[i] = fork();
+    if (rpid[i] < 0) goto done;
+    if (rpid[i] == 0) {
+      close(pfd[1]);
+      exit(reader(pfd[0], rfd[1]) ? 1 : 0);
+    }
+  }
+
+  /* the readers start at the first message */
+  for(i = 0; i < nreaders; i++)
+    if (read(rfd[0], &c, 1) != 1) goto done;
+
+  wpid = fork();
+  if (wpid < 0) goto done;
+  if (wpid == 0) exit(writer() ? 1 : 0);
+
+  close(pfd[0]);
+  waitpid(wpid, &ws, 0);
+  close(pfd[1]);
+  for(i = 0; i < nreaders; i++) {
+    waitpid(rpid[i], &rs, 0);
+    if (WIFEXITED(rs) && !WEXITSTATUS(rs)) ok++;
+  }
+
+  printf("%s: writer %s\n", name,
+    (WIFEXITED(ws) && !WEXITSTATUS(ws)) ? "ok" : "failed");
+  printf("%s: %u of %u readers ok\n", name, ok, nreaders);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  return rc;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("space", NREADERS, 0) < 0) goto done;
+  if (run("slots", 3, 8) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
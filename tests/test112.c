@@ -0,0 +1,153 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a monitor polls shr_stat, without the ring lock, while a
+ * writer and a reader stream messages through the ring. the
+ * counters it sees must only grow, and the unread amounts
+ * must fit the ring. then it resets the stats, and sees the
+ * new period start at zero. it runs on rings of several modes.
+ * (not SHR_SPSC, where the monitor would take the reader's role)
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 50000
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_MP",    SHR_MP},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+int writer(void) {
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(n=0; n < NMSG; n++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) break;
+  }
+
+  shr_close(s);
+  return (n == NMSG) ? 0 : -1;
+}
+
+int reader(void) {
+  char buf[sizeof(msg)];
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  for(n=0; n < NMSG; n++) {
+    if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) break;
+  }
+
+  shr_close(s);
+  return (n == NMSG) ? 0 : -1;
+}
+
+int monitor(char *name) {
+  struct shr_stat st, prev;
+  struct shr *s;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (s == NULL) goto done;
+  memset(&prev, 0, sizeof(prev));
+
+  /* poll until the reader is done */
+  while (prev.mr < NMSG) {
+    if (shr_stat(s, &st, NULL) < 0) goto done;
+    if ((st.mw < prev.mw) || (st.mr < prev.mr) ||
+        (st.bw < prev.bw) || (st.br < prev.br)) {
+      printf("%s: counters went back\n", name);
+      goto done;
+    }
+    if ((st.bu > st.bn) || (st.mu > st.mm)) {
+      printf("%s: unread %zu bytes %zu msgs exceeds ring\n", name,
+        st.bu, st.mu);
+      goto done;
+    }
+    prev = st;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int run(char *name, unsigned flags) {
+  struct timeval tv = { .tv_sec = 1 };
+  pid_t rpid, wpid, mpid;
+  struct shr_stat st;
+  int rs, ws, ms;
+  struct shr *s;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * 100, flags) < 0) return -1;
+
+  mpid = fork();
+  if (mpid < 0) return -1;
+  if (mpid == 0) exit(monitor(name) ? 1 : 0);
+
+  rpid = fork();
+  if (rpid < 0) return -1;
+  if (rpid == 0) exit(reader() ? 1 : 0);
+
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer() ? 1 : 0);
+
+  waitpid(wpid, &ws, 0);
+  waitpid(rpid, &rs, 0);
+  waitpid(mpid, &ms, 0);
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+  if (shr_stat(s, &st, &tv) < 0) return -1;
+  printf("%s: writer %s, reader %s, monitor %s, mw %zu mr %zu bu %zu\n",
+    name,
+    (WIFEXITED(ws) && !WEXITSTATUS(ws)) ? "ok" : "failed",
+    (WIFEXITED(rs) && !WEXITSTATUS(rs)) ? "ok" : "failed",
+    (WIFEXITED(ms) && !WEXITSTATUS(ms)) ? "ok" : "failed",
+    st.mw, st.mr, st.bu);
+  if (shr_stat(s, &st, NULL) < 0) return -1;
+  printf("%s: after reset: start %ld mw %zu mr %zu\n", name,
+    (long)st.start.tv_sec, st.mw, st.mr);
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  unsigned i;
+  int rc = -1;
+
+  for(i=0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
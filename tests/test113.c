@@ -0,0 +1,135 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* each client counts its i/o in a stats slot of its own. two
+ * writers and a reader do some i/o, then hold the ring open
+ * while the parent lists the clients (shr_stat_clients) and
+ * the totals (shr_stat). after they close the ring, or die
+ * without closing it, the totals keep their counts, and none
+ * is listed. the slot of the one that died stays taken until
+ * the slots run out, then it goes to a new client.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+/* do n writes (or reads, if n < 0) then tell the parent, and
+ * wait for its word to close the ring (or to die without) */
+int client(int n, int tfd, int gfd) {
+  char buf[sizeof(msg)], c;
+  struct shr *s;
+  int i;
+
+  s = shr_open(ring, (n > 0) ? SHR_WRONLY : SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  for(i = 0; i < abs(n); i++) {
+    if (n > 0) {
+      if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) return -1;
+    } else {
+      if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) return -1;
+    }
+  }
+
+  if (write(tfd, "d", 1) != 1) return -1;
+  if (read(gfd, &c, 1) != 1) return -1;
+  if (c == 'x') _exit(0);
+  shr_close(s);
+  return 0;
+}
+
+int cmp(const void *a, const void *b) {
+  const struct shr_client *x = a, *y = b;
+  return (int)(x->mw + x->mr) - (int)(y->mw + y->mr);
+}
+
+void totals(struct shr *s, char *when) {
+  struct shr_stat st;
+  if (shr_stat(s, &st, NULL) < 0) return;
+  printf("%s: mw %zu bw %zu mr %zu br %zu\n", when, st.mw, st.bw,
+    st.mr, st.br);
+}
+
+/* the number of clients listed */
+size_t listed(struct shr *s) {
+  struct shr_client cl[200];
+  size_t nc = 200;
+
+  if (shr_stat_clients(s, cl, &nc) < 0) return 0;
+  return nc;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int counts[] = { 10, 20, -30 };
+  struct shr_client cl[8];
+  int tfd[2], gfd[2];
+  struct shr *s = NULL, *h[130];
+  pid_t pid[3];
+  size_t nc, k;
+  int rc = -1;
+  unsigned i;
+  char c;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * 100, 0) < 0) goto done;
+  if (pipe(tfd) < 0) goto done;
+  if (pipe(gfd) < 0) goto done;
+
+  s = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (s == NULL) goto done;
+
+  for(i = 0; i < 3; i++) {
+    pid[i] = fork();
+    if (pid[i] < 0) goto done;
+    if (pid[i] == 0) exit(client(counts[i], tfd[1], gfd[0]) ? 1 : 0);
+  }
+  for(i = 0; i < 3; i++)
+    if (read(tfd[0], &c, 1) != 1) goto done;
+
+  /* the clients, other than ourselves */
+  nc = sizeof(cl) / sizeof(*cl);
+  if (shr_stat_clients(s, cl, &nc) < 0) goto done;
+  printf("%zu clients\n", nc);
+  qsort(cl, nc, sizeof(*cl), cmp);
+  for(k = 0; k < nc; k++) {
+    for(i = 0; i < 3; i++) if (pid[i] == cl[k].pid) break;
+    printf("client %u: %s mw %zu bw %zu mr %zu br %zu\n", i,
+      (cl[k].flags & SHR_WRONLY) ? "writer" : "reader",
+      cl[k].mw, cl[k].bw, cl[k].mr, cl[k].br);
+  }
+  totals(s, "open");
+
+  /* the first writer dies without closing, the rest close */
+  if (write(gfd[1], "xcc", 3) != 3) goto done;
+  for(i = 0; i < 3; i++) waitpid(pid[i], NULL, 0);
+
+  nc = sizeof(cl) / sizeof(*cl);
+  if (shr_stat_clients(s, cl, &nc) < 0) goto done;
+  printf("%zu clients after close\n", nc);
+  totals(s, "closed");
+
+  /* fill the slots, but the dead one's. the next client
+   * takes that over, and is listed; one sharing a slot isn't */
+  for(i = 0; i < 126; i++)
+    if ((h[i] = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK)) == NULL) goto done;
+  printf("slots full: %zu clients\n", listed(s));
+  if ((h[i] = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK)) == NULL) goto done;
+  printf("one more: %zu clients\n", listed(s));
+  totals(s, "taken over");
+  for(i = 0; i < 127; i++) shr_close(h[i]);
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
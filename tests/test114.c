@@ -0,0 +1,135 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a writer and reader stream concurrently through a small
+ * ring, both spinning before they block (SHR_SPIN). the
+ * writer pauses now and then, so the reader's spins both
+ * succeed and time out, as the writer's do when the reader
+ * falls behind. each message has a sequence number and a
+ * length/content derived from it. it runs on rings of
+ * several modes.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 50000
+#define MAXLEN 64
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(void) {
+  char buf[MAXLEN];
+  struct iovec iov[4];
+  char bufs[4][MAXLEN];
+  unsigned seq = 0, n;
+  struct shr *s;
+  size_t len;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+  if (shr_ctl(s, SHR_SPIN, 100U) < 0) goto done;
+
+  while (seq < NMSG) {
+    if (seq % 5000 == 0) usleep(2000);
+    if (seq % 10 == 0) {
+      /* a batch of writes */
+      for(n = 0; n < 4; n++) {
+        iov[n].iov_base = bufs[n];
+        iov[n].iov_len = fill(bufs[n], seq++);
+      }
+      if (shr_writev(s, iov, 4) <= 0) goto done;
+      continue;
+    }
+    len = fill(buf, seq++);
+    if (shr_write(s, buf, len) != (ssize_t)len) goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int reader(void) {
+  char buf[MAXLEN], exp[MAXLEN];
+  unsigned seq = 0;
+  struct shr *s;
+  size_t len;
+  ssize_t nr;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) goto done;
+  if (shr_ctl(s, SHR_SPIN, SHR_SPIN_MAX + 1) == 0) goto done;
+  if (shr_ctl(s, SHR_SPIN, 100U) < 0) goto done;
+
+  while (seq < NMSG) {
+    nr = shr_read(s, buf, sizeof(buf));
+    if (nr <= 0) goto done;
+    len = fill(exp, seq);
+    if ((nr != (ssize_t)len) || memcmp(buf, exp, len)) {
+      printf("reader: bad message at %u\n", seq);
+      goto done;
+    }
+    seq++;
+  }
+
+  printf("reader: %u messages in order\n", seq);
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int run(char *name, unsigned flags) {
+  pid_t rpid, wpid;
+  int rs, ws;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, flags|SHR_MAXMSGS_2, (size_t)32) < 0) return -1;
+
+  rpid = fork();
+  if (rpid < 0) return -1;
+  if (rpid == 0) exit(reader() ? 1 : 0);
+
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer() ? 1 : 0);
+
+  waitpid(wpid, &ws, 0);
+  waitpid(rpid, &rs, 0);
+  printf("%s: writer %s, reader %s\n", name,
+    (WIFEXITED(ws) && !WEXITSTATUS(ws)) ? "ok" : "failed",
+    (WIFEXITED(rs) && !WEXITSTATUS(rs)) ? "ok" : "failed");
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("file lock", 0) < 0) goto done;
+  if (run("SHR_MUTEX", SHR_MUTEX) < 0) goto done;
+  if (run("SHR_SPSC", SHR_SPSC) < 0) goto done;
+  if (run("SHR_MP", SHR_MP) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
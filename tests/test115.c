@@ -0,0 +1,244 @@
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* SHR_FUTEX rings. first a blocking writer and a blocking reader,
+ * both waiting on futexes, stream through a small ring in each
+ * lock mode. then a blocking (futex) reader and a non-blocking
+ * reader, waiting in select on its selectable fd, share the
+ * messages of one writer; each sees its messages in order, and
+ * between them they read them all. last, a blocking reader given
+ * a pipe (SHR_POLLFD) returns -3 when the pipe is readable, and
+ * still reads the ring after it.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 50000
+#define MAXLEN 64
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(void) {
+  char buf[MAXLEN];
+  unsigned seq;
+  struct shr *s;
+  size_t len;
+  int rc = -1;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+
+  for(seq = 0; seq < NMSG; seq++) {
+    if (seq % 5000 == 0) usleep(2000);
+    len = fill(buf, seq);
+    if (shr_write(s, buf, len) != (ssize_t)len) goto done;
+  }
+
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+/* read messages until the one numbered NMSG-1 turns up, checking
+ * they come in order. a non-blocking reader waits in select. the
+ * number read is written to fd, if given */
+int reader(int flags, int fd) {
+  char buf[MAXLEN], exp[MAXLEN];
+  unsigned seq, next = 0, n = 0;
+  struct shr *s;
+  fd_set rfds;
+  int rc = -1, sfd = -1;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_RDONLY | flags);
+  if (s == NULL) goto done;
+  if (flags & SHR_NONBLOCK) {
+    sfd = shr_get_selectable_fd(s);
+    if (sfd < 0) goto done;
+  }
+
+  while (next < NMSG) {
+    if (flags & SHR_NONBLOCK) {
+      FD_ZERO(&rfds);
+      FD_SET(sfd, &rfds);
+      if (select(sfd + 1, &rfds, NULL, NULL, NULL) < 0) goto done;
+    }
+    nr = shr_read(s, buf, sizeof(buf));
+    if (nr < 0) goto done;
+    if (nr == 0) continue;
+    memcpy(&seq, buf, sizeof(seq));
+    if ((seq < next) || (nr != (ssize_t)fill(exp, seq)) ||
+        memcmp(buf, exp, nr)) {
+      printf("reader: bad message at %u\n", next);
+      goto done;
+    }
+    next = seq + 1;
+    n++;
+  }
+
+  if (fd == -1) printf("reader: %u messages in order\n", n);
+  else if (write(fd, &n, sizeof(n)) != sizeof(n)) goto done;
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int run(char *name, unsigned flags) {
+  pid_t rpid, wpid;
+  int rs, ws;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, flags|SHR_FUTEX|SHR_MAXMSGS_2, (size_t)32) < 0)
+    return -1;
+
+  rpid = fork();
+  if (rpid < 0) return -1;
+  if (rpid == 0) exit(reader(0, -1) ? 1 : 0);
+
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer() ? 1 : 0);
+
+  waitpid(wpid, &ws, 0);
+  waitpid(rpid, &rs, 0);
+  printf("%s: writer %s, reader %s\n", name,
+    (WIFEXITED(ws) && !WEXITSTATUS(ws)) ? "ok" : "failed",
+    (WIFEXITED(rs) && !WEXITSTATUS(rs)) ? "ok" : "failed");
+  unlink(ring);
+  return 0;
+}
+
+/* a futex reader and a select reader share one writer's messages.
+ * the last message goes to one of them; the other is let go by a
+ * message numbered NMSG once the writer is done */
+int mixed(void) {
+  unsigned n, tot = 0;
+  pid_t rpid[2], wpid;
+  char buf[MAXLEN];
+  size_t len;
+  int pfd[2], ok = 0;
+  struct shr *s;
+  int k, st;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, SHR_FUTEX|SHR_MAXMSGS_2, (size_t)32) < 0)
+    return -1;
+  if (pipe(pfd) < 0) return -1;
+
+  for(k = 0; k < 2; k++) {
+    rpid[k] = fork();
+    if (rpid[k] < 0) return -1;
+    if (rpid[k] == 0) exit(reader(k ? SHR_NONBLOCK : 0, pfd[1]) ? 1 : 0);
+  }
+
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer() ? 1 : 0);
+  waitpid(wpid, &st, 0);
+  if (WIFEXITED(st) && !WEXITSTATUS(st)) ok++;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+  len = fill(buf, NMSG);
+  if (shr_write(s, buf, len) != (ssize_t)len) return -1;
+  shr_close(s);
+
+  for(k = 0; k < 2; k++) {
+    waitpid(rpid[k], &st, 0);
+    if (WIFEXITED(st) && !WEXITSTATUS(st)) ok++;
+    if (read(pfd[0], &n, sizeof(n)) != sizeof(n)) return -1;
+    tot += n;
+  }
+  close(pfd[0]);
+  close(pfd[1]);
+
+  /* less the message numbered NMSG */
+  printf("mixed: %d of 3 ok, %u messages read\n", ok, tot - 1);
+  unlink(ring);
+  return 0;
+}
+
+/* a blocking reader with a pipe to watch (SHR_POLLFD) */
+int pollfd(void) {
+  int pfd[2], gfd[2], rc = -1;
+  char buf[MAXLEN], c;
+  struct shr *s, *w;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, SHR_FUTEX) < 0) return -1;
+  if (pipe(pfd) < 0) return -1;
+  if (pipe(gfd) < 0) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    s = shr_open(ring, SHR_RDONLY);
+    if (s == NULL) exit(1);
+    if (shr_ctl(s, SHR_POLLFD, pfd[0]) < 0) exit(1);
+    if (write(gfd[1], "r", 1) != 1) exit(1);
+    nr = shr_read(s, buf, sizeof(buf));
+    printf("pollfd: read returns %zd\n", nr);
+    if (read(pfd[0], &c, 1) != 1) exit(1);
+    nr = shr_read(s, buf, sizeof(buf));
+    printf("pollfd: read returns %zd\n", nr);
+    shr_close(s);
+    exit(0);
+  }
+
+  if (read(gfd[0], &c, 1) != 1) goto done;
+  usleep(10000);
+  if (write(pfd[1], "x", 1) != 1) goto done;
+  usleep(10000);
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) goto done;
+  if (shr_write(w, "hello", 5) != 5) goto done;
+  shr_close(w);
+  waitpid(pid, &st, 0);
+  printf("pollfd: reader %s\n",
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed");
+  rc = 0;
+
+ done:
+  close(pfd[0]);
+  close(pfd[1]);
+  close(gfd[0]);
+  close(gfd[1]);
+  unlink(ring);
+  return rc;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("file lock", 0) < 0) goto done;
+  if (run("SHR_MUTEX", SHR_MUTEX) < 0) goto done;
+  if (run("SHR_SPSC", SHR_SPSC) < 0) goto done;
+  if (run("SHR_MP", SHR_MP) < 0) goto done;
+  if (mixed() < 0) goto done;
+  if (pollfd() < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
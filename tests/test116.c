@@ -0,0 +1,174 @@
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include "shr.h"
+
+/* a pool of readers on a (non-farm) ring compete for messages
+ * that a writer sends one at a time, with pauses in between. the
+ * writer wakes one waiting reader per message, rather than all of
+ * them, taking turns among them. first the readers are non-blocking
+ * ones waiting in select; few of their wakeups find nothing to read,
+ * and every reader gets a share of the messages. then the readers
+ * block on futexes (SHR_FUTEX), and again each gets a share.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NREADERS 8
+#define NMSG 200
+
+struct result {
+  unsigned n;        /* messages read */
+  unsigned spurious; /* wakeups finding none */
+};
+
+/* non-blocking reader: wait in select for the ring or for eof
+ * on fd (the writer is done), read until both are seen */
+int poller(int fd, int rfd, int tfd) {
+  struct result res = {0, 0};
+  int rc = -1, sfd, eof = 0;
+  struct shr *s;
+  char buf[16];
+  fd_set rfds;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (s == NULL) goto done;
+  sfd = shr_get_selectable_fd(s);
+  if (sfd < 0) goto done;
+  if (write(rfd, "r", 1) != 1) goto done;
+
+  while (1) {
+    FD_ZERO(&rfds);
+    FD_SET(sfd, &rfds);
+    if (!eof) FD_SET(fd, &rfds);
+    if (select(((sfd > fd) ? sfd : fd) + 1, &rfds, NULL, NULL, NULL) < 0)
+      goto done;
+    if (FD_ISSET(fd, &rfds)) eof = 1;
+    if (FD_ISSET(sfd, &rfds) || eof) {
+      nr = shr_read(s, buf, sizeof(buf));
+      if (nr < 0) goto done;
+      if (nr > 0) res.n++;
+      else if (eof) break;
+      else res.spurious++;
+    }
+  }
+
+  if (write(tfd, &res, sizeof(res)) != sizeof(res)) goto done;
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+/* blocking reader: read until a stop message (length 1) */
+int sleeper(int rfd, int tfd) {
+  struct result res = {0, 0};
+  struct shr *s;
+  char buf[16];
+  int rc = -1;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) goto done;
+  if (write(rfd, "r", 1) != 1) goto done;
+
+  while (1) {
+    nr = shr_read(s, buf, sizeof(buf));
+    if (nr <= 0) goto done;
+    if (nr == 1) break;
+    res.n++;
+  }
+
+  if (write(tfd, &res, sizeof(res)) != sizeof(res)) goto done;
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int run(char *name, unsigned flags) {
+  int pfd[2], rfd[2], tfd[2], st, ok = 0, fair = 1;
+  unsigned i, tot = 0, spurious = 0;
+  pid_t rpid[NREADERS];
+  struct result res;
+  struct shr *s;
+  char c;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, flags) < 0) return -1;
+  if (pipe(pfd) < 0) return -1;
+  if (pipe(rfd) < 0) return -1;
+  if (pipe(tfd) < 0) return -1;
+  if (fcntl(pfd[0], F_SETFL, O_NONBLOCK) < 0) return -1;
+
+  for(i = 0; i < NREADERS; i++) {
+    rpid[i] = fork();
+    if (rpid[i] < 0) return -1;
+    if (rpid[i] == 0) {
+      close(pfd[1]);
+      exit(((flags & SHR_FUTEX) ? sleeper(rfd[1], tfd[1]) :
+                                  poller(pfd[0], rfd[1], tfd[1])) ? 1 : 0);
+    }
+  }
+  for(i = 0; i < NREADERS; i++)
+    if (read(rfd[0], &c, 1) != 1) return -1;
+  usleep(10000);
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+  for(i = 0; i < NMSG; i++) {
+    if (shr_write(s, "message", 7) != 7) return -1;
+    usleep(1000);
+  }
+  if (flags & SHR_FUTEX) {
+    for(i = 0; i < NREADERS; i++)
+      if (shr_write(s, "x", 1) != 1) return -1;
+  }
+  shr_close(s);
+
+  close(pfd[0]);
+  close(pfd[1]);
+  for(i = 0; i < NREADERS; i++) {
+    waitpid(rpid[i], &st, 0);
+    if (WIFEXITED(st) && !WEXITSTATUS(st)) ok++;
+  }
+  for(i = 0; i < (unsigned)ok; i++) {
+    if (read(tfd[0], &res, sizeof(res)) != sizeof(res)) return -1;
+    tot += res.n;
+    spurious += res.spurious;
+    if (res.n == 0) fair = 0;
+  }
+  close(rfd[0]); close(rfd[1]);
+  close(tfd[0]); close(tfd[1]);
+
+  printf("%s: %d of %d readers ok, %u messages read\n", name, ok, NREADERS,
+    tot);
+  printf("%s: %s\n", name, fair ? "every reader read" :
+    "some readers read nothing");
+  printf("%s: %s\n", name, (spurious < NMSG / 4) ? "few spurious wakeups" :
+    "many spurious wakeups");
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("select", 0) < 0) goto done;
+  if (run("futex", SHR_FUTEX) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
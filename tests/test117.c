@@ -0,0 +1,205 @@
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include "shr.h"
+
+/* reader watermarks. a writer sends messages one at a time, with
+ * pauses between them, to a blocking reader that asked to wait for
+ * a batch of them (SHR_RDMIN_MSGS), or of bytes (SHR_RDMIN_BYTES).
+ * each of its reads gets a batch. then a reader asks for a batch it
+ * won't get, but for unread data to wait no longer than a delay
+ * (SHR_RDMAX_DELAY). a single message reaches it once the delay is
+ * up: blocking on bw, on a futex, and polling in select.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 100
+#define BATCH 10
+#define DELAY_US 20000
+char msg[] = "123456789";
+
+unsigned long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* read batches while NMSG messages leave room for one more; tell
+ * how many reads fell short of a batch */
+int batch_reader(int flag, size_t wm, int rfd, int tfd) {
+  char buf[sizeof(msg) * NMSG];
+  unsigned n = 0, short_reads = 0;
+  struct iovec iov[NMSG];
+  struct shr *s;
+  size_t niov;
+  int rc = -1;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) goto done;
+  if (shr_ctl(s, flag, wm) < 0) goto done;
+  if (write(rfd, "r", 1) != 1) goto done;
+
+  while (n + BATCH <= NMSG) {
+    niov = NMSG;
+    nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+    if (nr <= 0) goto done;
+    if (niov < BATCH) short_reads++;
+    n += niov;
+  }
+
+  if (write(tfd, &short_reads, sizeof(short_reads)) != sizeof(short_reads))
+    goto done;
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int batches(char *name, unsigned flags, int flag, size_t wm) {
+  int rfd[2], tfd[2], st;
+  unsigned i, short_reads;
+  struct shr *s;
+  pid_t pid;
+  char c;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * NMSG * 2, flags) < 0) return -1;
+  if (pipe(rfd) < 0) return -1;
+  if (pipe(tfd) < 0) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(batch_reader(flag, wm, rfd[1], tfd[1]) ? 1 : 0);
+  if (read(rfd[0], &c, 1) != 1) return -1;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+  for(i = 0; i < NMSG; i++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) return -1;
+    usleep(500);
+  }
+  shr_close(s);
+
+  waitpid(pid, &st, 0);
+  if (!WIFEXITED(st) || WEXITSTATUS(st)) {
+    printf("%s: reader failed\n", name);
+    return 0;
+  }
+  if (read(tfd[0], &short_reads, sizeof(short_reads)) != sizeof(short_reads))
+    return -1;
+  close(rfd[0]); close(rfd[1]);
+  close(tfd[0]); close(tfd[1]);
+
+  printf("%s: %s\n", name, short_reads ? "some reads short of a batch" :
+    "every read a batch");
+  unlink(ring);
+  return 0;
+}
+
+/* read one message; send the time it was read */
+int delay_reader(int nonblock, int rfd, int tfd) {
+  unsigned long long t;
+  int rc = -1, sfd = -1;
+  char buf[sizeof(msg)];
+  struct shr *s;
+  fd_set rfds;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_RDONLY | (nonblock ? SHR_NONBLOCK : 0));
+  if (s == NULL) goto done;
+  if (shr_ctl(s, SHR_RDMIN_MSGS, (size_t)NMSG) < 0) goto done;
+  if (shr_ctl(s, SHR_RDMAX_DELAY, (unsigned)DELAY_US) < 0) goto done;
+  if (nonblock) {
+    sfd = shr_get_selectable_fd(s);
+    if (sfd < 0) goto done;
+  }
+  if (write(rfd, "r", 1) != 1) goto done;
+
+  while (1) {
+    if (nonblock) {
+      FD_ZERO(&rfds);
+      FD_SET(sfd, &rfds);
+      if (select(sfd + 1, &rfds, NULL, NULL, NULL) < 0) goto done;
+    }
+    nr = shr_read(s, buf, sizeof(buf));
+    if (nr < 0) goto done;
+    if (nr > 0) break;
+  }
+
+  t = now_us();
+  if (write(tfd, &t, sizeof(t)) != sizeof(t)) goto done;
+  rc = 0;
+
+ done:
+  if (s) shr_close(s);
+  return rc;
+}
+
+int delay(char *name, unsigned flags, int nonblock) {
+  unsigned long long t0, t1, us;
+  int rfd[2], tfd[2], st;
+  struct shr *s;
+  pid_t pid;
+  char c;
+
+  unlink(ring);
+  if (shr_init(ring, 1024, flags) < 0) return -1;
+  if (pipe(rfd) < 0) return -1;
+  if (pipe(tfd) < 0) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(delay_reader(nonblock, rfd[1], tfd[1]) ? 1 : 0);
+  if (read(rfd[0], &c, 1) != 1) return -1;
+  usleep(10000);
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+  t0 = now_us();
+  if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) return -1;
+
+  waitpid(pid, &st, 0);
+  shr_close(s);
+  if (!WIFEXITED(st) || WEXITSTATUS(st)) {
+    printf("%s: reader failed\n", name);
+    return 0;
+  }
+  if (read(tfd[0], &t1, sizeof(t1)) != sizeof(t1)) return -1;
+  close(rfd[0]); close(rfd[1]);
+  close(tfd[0]); close(tfd[1]);
+
+  us = t1 - t0;
+  printf("%s: message read %s\n", name,
+    (us < DELAY_US * 3 / 4) ? "before the delay" :
+    (us > DELAY_US * 25) ? "long after the delay" : "after the delay");
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (batches("msgs", 0, SHR_RDMIN_MSGS, (size_t)BATCH) < 0) goto done;
+  if (batches("bytes", 0, SHR_RDMIN_BYTES, sizeof(msg) * BATCH) < 0)
+    goto done;
+  if (batches("futex msgs", SHR_FUTEX, SHR_RDMIN_MSGS, (size_t)BATCH) < 0)
+    goto done;
+  if (delay("bw delay", 0, 0) < 0) goto done;
+  if (delay("futex delay", SHR_FUTEX, 0) < 0) goto done;
+  if (delay("select delay", 0, 1) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,166 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a writer sends batches (shr_writev) into a small ring that a slow
+ * reader drains one message at a time. the writer blocks for room
+ * for a whole batch; it is woken once that much is free, rather than
+ * after each message read, so it sleeps about once per batch. its
+ * voluntary context switches show that. then two writers with
+ * batches of different sizes share the ring; all they write is read.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 2000
+#define BATCH 40
+#define SLOTS 64
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+  {"SHR_FUTEX", SHR_FUTEX},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+/* write n messages in batches; send our context switch count */
+int writer(unsigned n, unsigned batch, int fd) {
+  struct iovec iov[BATCH];
+  struct rusage ru;
+  struct shr *s;
+  unsigned i, k;
+  long csw;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(i = 0; i < batch; i++) {
+    iov[i].iov_base = msg;
+    iov[i].iov_len = sizeof(msg);
+  }
+
+  for(k = 0; k < n; k += batch) {
+    if (shr_writev(s, iov, batch) != (ssize_t)(sizeof(msg) * batch))
+      return -1;
+  }
+
+  shr_close(s);
+  if (getrusage(RUSAGE_SELF, &ru) < 0) return -1;
+  csw = ru.ru_nvcsw;
+  if (write(fd, &csw, sizeof(csw)) != sizeof(csw)) return -1;
+  return 0;
+}
+
+/* read n messages, slowly */
+int reader(unsigned n) {
+  char buf[sizeof(msg)];
+  struct shr *s;
+  unsigned i;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  for(i = 0; i < n; i++) {
+    if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) return -1;
+    if (memcmp(buf, msg, sizeof(msg))) return -1;
+    if (i % 4 == 0) usleep(100);
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  int pfd[2], rs, ws;
+  pid_t rpid, wpid;
+  long csw;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * SLOTS, flags|SHR_MAXMSGS_2,
+       (size_t)SLOTS) < 0) return -1;
+  if (pipe(pfd) < 0) return -1;
+
+  rpid = fork();
+  if (rpid < 0) return -1;
+  if (rpid == 0) exit(reader(NMSG) ? 1 : 0);
+
+  wpid = fork();
+  if (wpid < 0) return -1;
+  if (wpid == 0) exit(writer(NMSG, BATCH, pfd[1]) ? 1 : 0);
+
+  waitpid(wpid, &ws, 0);
+  waitpid(rpid, &rs, 0);
+  if (!WIFEXITED(ws) || WEXITSTATUS(ws) || !WIFEXITED(rs) || WEXITSTATUS(rs)) {
+    printf("%s: failed\n", name);
+    return 0;
+  }
+  if (read(pfd[0], &csw, sizeof(csw)) != sizeof(csw)) return -1;
+  close(pfd[0]);
+  close(pfd[1]);
+
+  printf("%s: writer and reader ok, writer woke %s\n", name,
+    (csw < NMSG / BATCH * 4) ? "about once per batch" : "too often");
+  unlink(ring);
+  return 0;
+}
+
+/* two writers, one with batches of BATCH, one of single messages */
+int two(char *name, unsigned flags) {
+  int pfd[2], st, ok = 0;
+  pid_t pid[3];
+  unsigned i;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * SLOTS, flags|SHR_MAXMSGS_2,
+       (size_t)SLOTS) < 0) return -1;
+  if (pipe(pfd) < 0) return -1;
+
+  for(i = 0; i < 3; i++) {
+    pid[i] = fork();
+    if (pid[i] < 0) return -1;
+    if (pid[i] == 0) {
+      if (i == 0) exit(reader(NMSG * 2) ? 1 : 0);
+      exit(writer(NMSG, (i == 1) ? BATCH : 1, pfd[1]) ? 1 : 0);
+    }
+  }
+  for(i = 0; i < 3; i++) {
+    waitpid(pid[i], &st, 0);
+    if (WIFEXITED(st) && !WEXITSTATUS(st)) ok++;
+  }
+  close(pfd[0]);
+  close(pfd[1]);
+
+  printf("%s: two writers: %d of 3 ok\n", name, ok);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+    if (modes[i].flags & SHR_SPSC) continue;
+    if (two(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
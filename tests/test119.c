@@ -0,0 +1,151 @@
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a non-blocking writer polls for room (SHR_WRROOM). it has no
+ * selectable fd until it asks shr_ctl for one. then it waits in
+ * select for room for a batch, and writes the batch, while a slow
+ * reader drains the ring. the fd is readable at the start, when
+ * the ring is empty, and not once the ring is full. the writer gets
+ * few spurious wakeups, and the reader gets every message.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 2000
+#define BATCH 40
+#define SLOTS 64
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+  {"SHR_FUTEX", SHR_FUTEX},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+int readable(int fd) {
+  struct timeval tv = {0, 0};
+  fd_set rfds;
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+  return (select(fd + 1, &rfds, NULL, NULL, &tv) > 0) ? 1 : 0;
+}
+
+/* read n messages, slowly */
+int reader(unsigned n) {
+  char buf[sizeof(msg)];
+  struct shr *s;
+  unsigned i;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  for(i = 0; i < n; i++) {
+    if (shr_read(s, buf, sizeof(buf)) != sizeof(msg)) return -1;
+    if (memcmp(buf, msg, sizeof(msg))) return -1;
+    if (i % 4 == 0) usleep(100);
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  unsigned n = 0, spurious = 0, i;
+  struct iovec iov[BATCH];
+  struct shr *s;
+  fd_set rfds;
+  ssize_t nr;
+  pid_t pid;
+  int fd, st;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * SLOTS, flags|SHR_MAXMSGS_2,
+       (size_t)SLOTS) < 0) return -1;
+
+  s = shr_open(ring, SHR_WRONLY | SHR_NONBLOCK);
+  if (s == NULL) return -1;
+  if (shr_get_selectable_fd(s) != -1) printf("%s: fd before shr_ctl\n", name);
+  if (shr_ctl(s, SHR_WRROOM, sizeof(msg) * BATCH, (size_t)BATCH) < 0)
+    return -1;
+  fd = shr_get_selectable_fd(s);
+  if (fd < 0) return -1;
+  printf("%s: empty ring: fd %s\n", name, readable(fd) ? "readable" :
+    "not readable");
+
+  for(i = 0; i < BATCH; i++) {
+    iov[i].iov_base = msg;
+    iov[i].iov_len = sizeof(msg);
+  }
+
+  /* fill the ring, then let the reader at it */
+  while (1) {
+    nr = shr_writev(s, iov, BATCH);
+    if (nr < 0) return -1;
+    if (nr == 0) break;
+    n += BATCH;
+  }
+  printf("%s: full ring: fd %s\n", name, readable(fd) ? "readable" :
+    "not readable");
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(reader(NMSG) ? 1 : 0);
+
+  while (n < NMSG) {
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    if (select(fd + 1, &rfds, NULL, NULL, NULL) < 0) return -1;
+    nr = shr_writev(s, iov, BATCH);
+    if (nr < 0) return -1;
+    if (nr == 0) spurious++;
+    else n += BATCH;
+  }
+
+  waitpid(pid, &st, 0);
+  shr_close(s);
+  printf("%s: reader %s, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed",
+    (spurious < NMSG / BATCH) ? "few spurious wakeups" :
+    "many spurious wakeups");
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  struct shr *s;
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+
+  /* blocking writers don't poll */
+  unlink(ring);
+  if (shr_init(ring, 1024, 0) < 0) goto done;
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+  printf("blocking writer: shr_ctl %d fd %d\n",
+    shr_ctl(s, SHR_WRROOM, (size_t)1, (size_t)1),
+    shr_get_selectable_fd(s));
+  shr_close(s);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
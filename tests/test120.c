@@ -0,0 +1,105 @@
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a non-blocking reader waits in epoll, edge-triggered (EPOLLET),
+ * on its selectable fd. on each edge it reads until shr_read
+ * returns 0, as EPOLLET requires. a writer sends bursts of
+ * messages, pausing in between, so the reader sees many edges.
+ * it gets every message, and never waits a second for an edge
+ * with unread messages in the ring.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define BURST 100
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+int writer(void) {
+  struct shr *s;
+  unsigned n;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(n = 0; n < NMSG; n++) {
+    if (shr_write(s, msg, sizeof(msg)) != sizeof(msg)) return -1;
+    if (n % BURST == 0) usleep(500);
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  unsigned n = 0, edges = 0, stalls = 0;
+  struct epoll_event ev;
+  char buf[sizeof(msg)];
+  int efd, fd, sc, st;
+  struct shr *s;
+  ssize_t nr;
+  pid_t pid;
+
+  unlink(ring);
+  if (shr_init(ring, sizeof(msg) * 1000, flags) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (s == NULL) return -1;
+  fd = shr_get_selectable_fd(s);
+  if (fd < 0) return -1;
+  efd = epoll_create1(0);
+  if (efd < 0) return -1;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.fd = fd;
+  if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer() ? 1 : 0);
+
+  while (n < NMSG) {
+    sc = epoll_wait(efd, &ev, 1, 1000);
+    if (sc < 0) return -1;
+    if (sc == 0) {
+      /* no edge for a second. is data waiting unseen? */
+      nr = shr_read(s, buf, sizeof(buf));
+      if (nr < 0) return -1;
+      if (nr > 0) { stalls++; n++; }
+      continue;
+    }
+    edges++;
+    while ((nr = shr_read(s, buf, sizeof(buf))) > 0) n++;
+    if (nr < 0) return -1;
+  }
+
+  waitpid(pid, &st, 0);
+  printf("%s: writer %s, %u messages read, %s, %u stalls\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed", n,
+    (edges > 1) ? "many edges" : "one edge", stalls);
+  close(efd);
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("file lock", 0) < 0) goto done;
+  if (run("SHR_SPSC", SHR_SPSC) < 0) goto done;
+  if (run("SHR_MP", SHR_MP) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
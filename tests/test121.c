@@ -0,0 +1,178 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* zero-copy reads (shr_read_peek, shr_read_release). a writer
+ * streams messages of varied sizes through a small ring, so some
+ * wrap around its end, while a reader peeks at them in place and
+ * checks each, whole or in two parts. that's done in several modes.
+ * then, in SHR_DROP mode, a reader holds a peeked message while a writer overruns the ring;
+ * the message stays intact, the writer waiting for it, until it is
+ * released. a farm reader can't peek.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define MAXLEN 100
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(unsigned n) {
+  char buf[MAXLEN];
+  struct shr *s;
+  unsigned seq;
+  size_t len;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(seq = 0; seq < n; seq++) {
+    len = fill(buf, seq);
+    if (shr_write(s, buf, len) != (ssize_t)len) return -1;
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+/* join the two parts of peeked message k into buf */
+size_t join(struct iovec *iov, size_t k, char *buf) {
+  memcpy(buf, iov[2*k].iov_base, iov[2*k].iov_len);
+  memcpy(buf + iov[2*k].iov_len, iov[2*k+1].iov_base, iov[2*k+1].iov_len);
+  return iov[2*k].iov_len + iov[2*k+1].iov_len;
+}
+
+int run(char *name, unsigned flags) {
+  unsigned seq = 0, wraps = 0, bad = 0;
+  char buf[MAXLEN], exp[MAXLEN];
+  struct iovec iov[16];
+  struct shr *s;
+  size_t niov, k, len;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer(NMSG) ? 1 : 0);
+
+  while (seq < NMSG) {
+    niov = adim(iov);
+    nr = shr_read_peek(s, iov, &niov);
+    if (nr <= 0) return -1;
+    for(k = 0; k < niov; k++, seq++) {
+      if (iov[2*k+1].iov_len) wraps++;
+      len = join(iov, k, buf);
+      if ((len != fill(exp, seq)) || memcmp(buf, exp, len)) bad++;
+    }
+    if (shr_read_release(s) < 0) return -1;
+  }
+
+  waitpid(pid, &st, 0);
+  printf("%s: writer %s, %u messages peeked, %s, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed", seq,
+    bad ? "some bad" : "all good", wraps ? "some wrapped" : "none wrapped");
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+/* in SHR_DROP mode, a peeked message is kept from the writer */
+int drop(void) {
+  char buf[MAXLEN], exp[MAXLEN];
+  struct iovec iov[2];
+  struct shr *s;
+  size_t niov, len;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, SHR_DROP) < 0) return -1;
+  if (writer(5) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+  niov = 2;
+  nr = shr_read_peek(s, iov, &niov);
+  if (nr <= 0) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer(200) ? 1 : 0);
+  usleep(20000);
+
+  len = join(iov, 0, buf);
+  printf("drop: held message %s, writer %s\n",
+    ((len == fill(exp, 0)) && !memcmp(buf, exp, len)) ? "intact" : "overrun",
+    waitpid(pid, &st, WNOHANG) ? "done" : "waiting");
+  if (shr_read_release(s) < 0) return -1;
+  waitpid(pid, &st, 0);
+  printf("drop: writer %s\n",
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed");
+
+  /* no second peek before release */
+  niov = 2;
+  nr = shr_read_peek(s, iov, &niov);
+  printf("drop: peek %s, again %zd\n", (nr > 0) ? "ok" : "failed",
+    shr_read_peek(s, iov, &niov));
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  struct iovec iov[2];
+  struct shr *s;
+  size_t niov;
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+  if (drop() < 0) goto done;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, SHR_FARM) < 0) goto done;
+  s = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (s == NULL) goto done;
+  niov = 2;
+  printf("farm: peek %zd\n", shr_read_peek(s, iov, &niov));
+  shr_close(s);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,194 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* zero-copy writes (shr_write_reserve, shr_write_commit). a writer
+ * reserves space for messages of varied sizes in a small ring, so
+ * some wrap around its end, fills each in place, whole or in two
+ * parts, and commits it; every so often it aborts one instead. a
+ * reader checks it gets the committed messages, in order. that's
+ * done in several modes. then a reserved message is seen not to be readable until committed, and
+ * a reservation can't be doubled up. while one writer holds a
+ * reservation, another writes past it, and readers aren't blocked.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define MAXLEN 100
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+  {"SHR_FUTEX", SHR_FUTEX},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+/* commit messages 0..n-1; reserve and abort every seventh first */
+int writer(unsigned n, unsigned *wraps) {
+  struct iovec iov[2];
+  char buf[MAXLEN];
+  struct shr *s;
+  unsigned seq;
+  size_t len;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(seq = 0; seq < n; seq++) {
+    len = fill(buf, seq);
+    if ((seq % 7) == 0) {
+      if (shr_write_reserve(s, MAXLEN, iov) != MAXLEN) return -1;
+      memset(iov[0].iov_base, 0, iov[0].iov_len);
+      if (shr_write_abort(s) < 0) return -1;
+    }
+    if (shr_write_reserve(s, len, iov) != (ssize_t)len) return -1;
+    if (iov[0].iov_len + iov[1].iov_len != len) return -1;
+    if (iov[1].iov_len) (*wraps)++;
+    memcpy(iov[0].iov_base, buf, iov[0].iov_len);
+    memcpy(iov[1].iov_base, buf + iov[0].iov_len, iov[1].iov_len);
+    if (shr_write_commit(s) < 0) return -1;
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  char buf[MAXLEN], exp[MAXLEN];
+  unsigned seq, bad = 0, wraps = 0;
+  struct shr *s;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    s = shr_open(ring, SHR_RDONLY);
+    if (s == NULL) exit(1);
+    for(seq = 0; seq < NMSG; seq++) {
+      nr = shr_read(s, buf, sizeof(buf));
+      if (nr <= 0) exit(1);
+      if (((size_t)nr != fill(exp, seq)) || memcmp(buf, exp, nr)) bad++;
+    }
+    shr_close(s);
+    exit(bad ? 2 : 0);
+  }
+
+  if (writer(NMSG, &wraps) < 0) return -1;
+  waitpid(pid, &st, 0);
+  printf("%s: reader %s, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "got all, all good" :
+    (WIFEXITED(st) && (WEXITSTATUS(st) == 2)) ? "got some bad" : "failed",
+    wraps ? "some wrapped" : "none wrapped");
+  unlink(ring);
+  return 0;
+}
+
+/* nothing is readable until the commit */
+int pending(char *name, unsigned flags) {
+  struct shr *w, *r;
+  struct iovec iov[2];
+  char buf[MAXLEN];
+  ssize_t nr;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+  w = shr_open(ring, SHR_WRONLY | SHR_NONBLOCK);
+  if (w == NULL) return -1;
+  r = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (r == NULL) return -1;
+
+  if (shr_write_reserve(w, 5, iov) != 5) return -1;
+  memcpy(iov[0].iov_base, "hello", 5);
+  printf("%s: reserved: again %zd, write %zd\n", name,
+    shr_write_reserve(w, 5, iov), shr_write(w, "x", 1));
+  printf("%s: reserved: read %zd\n", name, shr_read(r, buf, sizeof(buf)));
+  if (shr_write_commit(w) < 0) return -1;
+  nr = shr_read(r, buf, sizeof(buf));
+  printf("%s: committed: read %zd %.*s, commit again %d\n", name, nr,
+    (int)((nr > 0) ? nr : 0), buf, shr_write_commit(w));
+
+  /* a reservation left open at close is aborted */
+  if (shr_write_reserve(w, 5, iov) != 5) return -1;
+  shr_close(w);
+  printf("%s: closed: read %zd\n", name, shr_read(r, buf, sizeof(buf)));
+  shr_close(r);
+  unlink(ring);
+  return 0;
+}
+
+/* no lock is held from reserve to commit */
+int others(char *name, unsigned flags) {
+  struct shr *w, *w2, *r;
+  struct iovec iov[2];
+  char buf[MAXLEN];
+  ssize_t nr;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+  w = shr_open(ring, SHR_WRONLY | SHR_NONBLOCK);
+  if (w == NULL) return -1;
+  w2 = shr_open(ring, SHR_WRONLY | SHR_NONBLOCK);
+  if (w2 == NULL) return -1;
+  r = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (r == NULL) return -1;
+
+  if (shr_write_reserve(w, 5, iov) != 5) return -1;
+  memcpy(iov[0].iov_base, "first", 5);
+  printf("%s: reserved: other writer %zd, read %zd\n", name,
+    shr_write(w2, "second", 6), shr_read(r, buf, sizeof(buf)));
+  if (shr_write_commit(w) < 0) return -1;
+  while ((nr = shr_read(r, buf, sizeof(buf))) > 0)
+    printf("%s: committed: read %.*s\n", name, (int)nr, buf);
+
+  shr_close(w);
+  shr_close(w2);
+  shr_close(r);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+  if (pending("file lock", 0) < 0) goto done;
+  if (pending("SHR_MP", SHR_MP) < 0) goto done;
+  if (pending("SHR_DROP", SHR_DROP) < 0) goto done;
+  if (others("file lock", 0) < 0) goto done;
+  if (others("SHR_MUTEX", SHR_MUTEX) < 0) goto done;
+  if (others("SHR_MP", SHR_MP) < 0) goto done;
+  if (others("SHR_DROP", SHR_DROP) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
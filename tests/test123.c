@@ -0,0 +1,143 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a ring whose data is mapped twice, back to back (SHR_MIRROR). a
+ * writer streams messages of varied sizes through it, some written
+ * in place (shr_write_reserve), the rest copied in. a reader peeks
+ * at some and copies out the rest. the messages go round the ring
+ * many times, yet each reserved or peeked message is one span. that's
+ * done in several modes. the ring size is rounded up to a page.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define MAXLEN 300
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(unsigned n) {
+  struct iovec iov[2];
+  char buf[MAXLEN];
+  struct shr *s;
+  unsigned seq;
+  size_t len;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  for(seq = 0; seq < n; seq++) {
+    len = fill(buf, seq);
+    if (seq % 2) {
+      if (shr_write(s, buf, len) != (ssize_t)len) return -1;
+      continue;
+    }
+    if (shr_write_reserve(s, len, iov) != (ssize_t)len) return -1;
+    if ((iov[0].iov_len != len) || iov[1].iov_len) return -1;
+    memcpy(iov[0].iov_base, buf, len);
+    if (shr_write_commit(s) < 0) return -1;
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  unsigned seq = 0, bad = 0, split = 0, laps = 0;
+  char buf[MAXLEN], exp[MAXLEN], *last = NULL;
+  struct iovec iov[16];
+  size_t niov, k, len;
+  struct shr *s;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 5000, flags|SHR_MIRROR) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer(NMSG) ? 1 : 0);
+
+  while (seq < NMSG) {
+    if (seq % 3) {
+      nr = shr_read(s, buf, sizeof(buf));
+      if (nr <= 0) return -1;
+      if (((size_t)nr != fill(exp, seq)) || memcmp(buf, exp, nr)) bad++;
+      seq++;
+      continue;
+    }
+    niov = adim(iov);
+    nr = shr_read_peek(s, iov, &niov);
+    if (nr <= 0) return -1;
+    for(k = 0; k < niov; k++, seq++) {
+      if (iov[2*k+1].iov_len) split++;
+      if ((char*)iov[2*k].iov_base < last) laps++;
+      last = iov[2*k].iov_base;
+      len = iov[2*k].iov_len;
+      if ((len != fill(exp, seq)) || memcmp(iov[2*k].iov_base, exp, len)) bad++;
+    }
+    if (shr_read_release(s) < 0) return -1;
+  }
+
+  waitpid(pid, &st, 0);
+  printf("%s: writer %s, %u messages read, %s, %s, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed", seq,
+    bad ? "some bad" : "all good", split ? "some split" : "none split",
+    (laps > 1) ? "many laps" : "no laps");
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  char buf[4000];
+  struct shr *s;
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+
+  /* a 1000 byte ring holds a page */
+  unlink(ring);
+  if (shr_init(ring, 1000, SHR_MIRROR) < 0) goto done;
+  s = shr_open(ring, SHR_WRONLY | SHR_NONBLOCK);
+  if (s == NULL) goto done;
+  memset(buf, 0, sizeof(buf));
+  printf("rounded: write %zd\n", shr_write(s, buf, sizeof(buf)));
+  shr_close(s);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
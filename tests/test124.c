@@ -0,0 +1,123 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* batches whose messages lie back to back in the caller's memory are
+ * copied into and out of the ring in runs. a writer sends batches of
+ * messages carved out of one buffer, except that every fifth message
+ * is in a buffer of its own, breaking the run. a reader takes them in
+ * batches (shr_readv) into its buffer. the small ring makes the runs
+ * wrap around its end. every message arrives intact and in order.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define BATCH 16
+#define MAXLEN 60
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+  {"SHR_MIRROR", SHR_MIRROR},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(void) {
+  char buf[BATCH * MAXLEN], own[BATCH][MAXLEN], *b;
+  struct iovec iov[BATCH];
+  unsigned seq = 0, k;
+  struct shr *s;
+  size_t len;
+  ssize_t nr;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  while (seq < NMSG) {
+    b = buf;
+    len = 0;
+    for(k = 0; (k < BATCH) && (seq < NMSG); k++, seq++) {
+      iov[k].iov_base = (seq % 5) ? b : own[k];
+      iov[k].iov_len = fill(iov[k].iov_base, seq);
+      if (seq % 5) b += iov[k].iov_len;
+      len += iov[k].iov_len;
+    }
+    nr = shr_writev(s, iov, k);
+    if (nr != (ssize_t)len) return -1;
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  char buf[BATCH * MAXLEN], exp[MAXLEN];
+  unsigned seq = 0, bad = 0;
+  struct iovec iov[BATCH];
+  size_t niov, k;
+  struct shr *s;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer() ? 1 : 0);
+
+  while (seq < NMSG) {
+    niov = adim(iov);
+    nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+    if (nr <= 0) return -1;
+    for(k = 0; k < niov; k++, seq++) {
+      if ((iov[k].iov_len != fill(exp, seq)) ||
+          memcmp(iov[k].iov_base, exp, iov[k].iov_len)) bad++;
+    }
+  }
+
+  waitpid(pid, &st, 0);
+  printf("%s: writer %s, %u messages read, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed", seq,
+    bad ? "some bad" : "all good");
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,156 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* packed batches (shr_write_packed, shr_read_packed): one buffer of
+ * messages back to back, plus a length per message. a writer sends
+ * packed batches of varied sizes through a small ring; a reader takes
+ * them packed, or now and then with shr_readv, and checks each. that's
+ * done in several modes. a buffered writer's cached messages go ahead
+ * of a packed batch. zero length messages are refused.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define BATCH 16
+#define MAXLEN 60
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_MUTEX", SHR_MUTEX},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+  {"SHR_MIRROR", SHR_MIRROR},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int writer(void) {
+  char buf[BATCH * MAXLEN];
+  uint32_t lens[BATCH];
+  unsigned seq = 0, k;
+  struct shr *s;
+  size_t len;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  while (seq < NMSG) {
+    len = 0;
+    for(k = 0; (k < 1 + seq % BATCH) && (seq < NMSG); k++, seq++) {
+      lens[k] = fill(buf + len, seq);
+      len += lens[k];
+    }
+    if (shr_write_packed(s, buf, lens, k) != (ssize_t)len) return -1;
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  char buf[BATCH * MAXLEN], exp[MAXLEN], *b;
+  unsigned seq = 0, bad = 0, n = 0;
+  struct iovec iov[BATCH];
+  uint32_t lens[BATCH];
+  size_t niov, k;
+  struct shr *s;
+  ssize_t nr;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer() ? 1 : 0);
+
+  while (seq < NMSG) {
+    if (n++ % 10 == 0) {
+      niov = adim(iov);
+      nr = shr_readv(s, buf, sizeof(buf), iov, &niov);
+      if (nr <= 0) return -1;
+      for(k = 0; k < niov; k++, seq++) {
+        if ((iov[k].iov_len != fill(exp, seq)) ||
+            memcmp(iov[k].iov_base, exp, iov[k].iov_len)) bad++;
+      }
+      continue;
+    }
+    niov = adim(lens);
+    nr = shr_read_packed(s, buf, sizeof(buf), lens, &niov);
+    if (nr <= 0) return -1;
+    for(b = buf, k = 0; k < niov; b += lens[k], k++, seq++) {
+      if ((lens[k] != fill(exp, seq)) || memcmp(b, exp, lens[k])) bad++;
+    }
+    if (b != buf + nr) bad++;
+  }
+
+  waitpid(pid, &st, 0);
+  printf("%s: writer %s, %u messages read, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed", seq,
+    bad ? "some bad" : "all good");
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  uint32_t lens[3] = {3, 0, 3};
+  char buf[100];
+  struct shr *w, *r;
+  size_t n;
+  ssize_t nr;
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+
+  unlink(ring);
+  if (shr_init(ring, 1000, 0) < 0) goto done;
+  w = shr_open(ring, SHR_WRONLY | SHR_BUFFERED);
+  if (w == NULL) goto done;
+  r = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (r == NULL) goto done;
+  printf("zero length: %zd\n", shr_write_packed(w, "abcdef", lens, 3));
+  if (shr_write(w, "abc", 3) != 3) goto done;
+  lens[1] = 2;
+  if (shr_write_packed(w, "defghijk", lens, 3) != 8) goto done;
+  n = 2;
+  nr = shr_read_packed(r, buf, sizeof(buf), lens, &n);
+  printf("buffered: %zd bytes, %zu messages: %.*s|%.*s\n", nr, n,
+    (int)lens[0], buf, (int)lens[1], buf + lens[0]);
+  n = 2;
+  nr = shr_read_packed(r, buf, 4, lens, &n);
+  printf("small buffer: %zd bytes, %zu messages: %.*s\n", nr, n,
+    (int)lens[0], buf);
+  shr_close(w);
+  shr_close(r);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,140 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* gather writes (shr_writemsg). a writer frames each message as a
+ * header, a payload and a trailer in buffers of their own, and sends
+ * batches of such messages through a small ring, so some wrap around
+ * its end. a reader gets each message whole, and checks it. that's
+ * done in several modes. empty messages are refused.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NMSG 20000
+#define BATCH 8
+#define MAXLEN 60
+
+struct {
+  char *name;
+  unsigned flags;
+} modes[] = {
+  {"file lock", 0},
+  {"SHR_SPSC",  SHR_SPSC},
+  {"SHR_MP",    SHR_MP},
+  {"SHR_MIRROR", SHR_MIRROR},
+};
+
+#define adim(x) (sizeof(x)/sizeof(*x))
+
+size_t fill(char *buf, unsigned seq) {
+  size_t i, len = sizeof(seq) + (seq % (MAXLEN - sizeof(seq)));
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+char trailer[] = "\n";
+
+int writer(void) {
+  char body[BATCH][MAXLEN];
+  uint32_t hdr[BATCH];
+  struct iovec seg[BATCH][3];
+  struct shr_msg msgs[BATCH];
+  unsigned seq = 0, k;
+  struct shr *s;
+  size_t len;
+
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) return -1;
+
+  while (seq < NMSG) {
+    len = 0;
+    for(k = 0; (k < 1 + seq % BATCH) && (seq < NMSG); k++, seq++) {
+      hdr[k] = fill(body[k], seq);
+      seg[k][0].iov_base = &hdr[k];
+      seg[k][0].iov_len = sizeof(hdr[k]);
+      seg[k][1].iov_base = body[k];
+      seg[k][1].iov_len = hdr[k];
+      seg[k][2].iov_base = trailer;
+      seg[k][2].iov_len = (seq % 2) ? 1 : 0;
+      msgs[k].iov = seg[k];
+      msgs[k].iovcnt = 3;
+      len += sizeof(hdr[k]) + hdr[k] + seg[k][2].iov_len;
+    }
+    if (shr_writemsg(s, msgs, k) != (ssize_t)len) return -1;
+  }
+
+  shr_close(s);
+  return 0;
+}
+
+int run(char *name, unsigned flags) {
+  char buf[sizeof(uint32_t) + MAXLEN + 1], exp[MAXLEN];
+  unsigned seq = 0, bad = 0;
+  struct shr *s;
+  uint32_t hdr;
+  ssize_t nr;
+  size_t el;
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+
+  s = shr_open(ring, SHR_RDONLY);
+  if (s == NULL) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) exit(writer() ? 1 : 0);
+
+  for(seq = 0; seq < NMSG; seq++) {
+    nr = shr_read(s, buf, sizeof(buf));
+    if (nr <= 0) return -1;
+    el = fill(exp, seq);
+    memcpy(&hdr, buf, sizeof(hdr));
+    if ((hdr != el) ||
+        ((size_t)nr != sizeof(hdr) + el + (seq % 2)) ||
+        memcmp(buf + sizeof(hdr), exp, el) ||
+        ((seq % 2) && (buf[nr - 1] != '\n'))) bad++;
+  }
+
+  waitpid(pid, &st, 0);
+  printf("%s: writer %s, %u messages read, %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "ok" : "failed", seq,
+    bad ? "some bad" : "all good");
+  shr_close(s);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  struct iovec seg[2] = {{trailer, 0}, {trailer, 0}};
+  struct shr_msg msg = {seg, 2};
+  struct shr *s;
+  unsigned i;
+  int rc = -1;
+
+  for(i = 0; i < adim(modes); i++) {
+    if (run(modes[i].name, modes[i].flags) < 0) goto done;
+  }
+
+  unlink(ring);
+  if (shr_init(ring, 1000, 0) < 0) goto done;
+  s = shr_open(ring, SHR_WRONLY);
+  if (s == NULL) goto done;
+  printf("empty message: %zd\n", shr_writemsg(s, &msg, 1));
+  shr_close(s);
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,114 @@
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* reclaiming space for a write by binary search. one process writes
+ * messages of mixed sizes, mostly small with now and then a large
+ * one, and reads some of them back, in random order. a model of the
+ * ring predicts what each read returns: in SHR_DROP mode, which unread
+ * messages a write drops; otherwise, whether a non-blocking write
+ * fits. the ring agrees with the model, and its drop counts too.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define NOPS 200000
+#define RING_SZ 5000
+#define SLOTS 100
+#define BIG 1500
+
+/* the model: seq and len of the unread messages, in order */
+unsigned qseq[SLOTS], qlen[SLOTS], qh, qn, qb;
+
+void push(unsigned seq, unsigned len) {
+  qseq[(qh + qn) % SLOTS] = seq;
+  qlen[(qh + qn) % SLOTS] = len;
+  qn++;
+  qb += len;
+}
+
+void pop(void) {
+  qb -= qlen[qh];
+  qh = (qh + 1) % SLOTS;
+  qn--;
+}
+
+size_t fill(char *buf, unsigned seq, size_t len) {
+  size_t i;
+  memcpy(buf, &seq, sizeof(seq));
+  for(i = sizeof(seq); i < len; i++) buf[i] = (char)(seq + i);
+  return len;
+}
+
+int run(char *name, unsigned flags) {
+  unsigned seq = 0, op, len, bad = 0, dropped = 0, full = 0;
+  char buf[BIG], exp[BIG];
+  struct shr_stat st;
+  struct shr *w, *r;
+  ssize_t nr;
+
+  qh = qn = qb = 0;
+  srand(1);
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, flags|SHR_MAXMSGS_2, (size_t)SLOTS) < 0)
+    return -1;
+  w = shr_open(ring, SHR_WRONLY | SHR_NONBLOCK);
+  if (w == NULL) return -1;
+  r = shr_open(ring, SHR_RDONLY | SHR_NONBLOCK);
+  if (r == NULL) return -1;
+
+  for(op = 0; op < NOPS; op++) {
+    if (rand() % 3) {
+      len = (rand() % 50 == 0) ? BIG : (sizeof(seq) + rand() % 60);
+      fill(buf, seq, len);
+      nr = shr_write(w, buf, len);
+      if (flags & SHR_DROP) {
+        while ((RING_SZ - qb < len) || (qn == SLOTS)) { pop(); dropped++; }
+      } else if ((RING_SZ - qb < len) || (qn == SLOTS)) {
+        if (nr != 0) bad++;
+        full++;
+        continue;
+      }
+      if (nr != (ssize_t)len) bad++;
+      push(seq++, len);
+      continue;
+    }
+    nr = shr_read(r, buf, sizeof(buf));
+    if (qn == 0) {
+      if (nr != 0) bad++;
+      continue;
+    }
+    len = fill(exp, qseq[qh], qlen[qh]);
+    if ((nr != (ssize_t)len) || memcmp(buf, exp, len)) bad++;
+    pop();
+  }
+
+  if (shr_stat(w, &st, NULL) < 0) return -1;
+  printf("%s: %s, %s, %s\n", name, bad ? "some mismatch" : "all match",
+    (flags & SHR_DROP) ?
+      ((st.md == dropped) && dropped ? "drops match" : "drops differ") :
+      (full ? "some writes found it full" : "never full"),
+    seq > NOPS / 10 ? "many writes" : "few writes");
+  shr_close(w);
+  shr_close(r);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("SHR_DROP", SHR_DROP) < 0) goto done;
+  if (run("file lock", 0) < 0) goto done;
+  if (run("SHR_MUTEX", SHR_MUTEX) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
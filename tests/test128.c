@@ -0,0 +1,82 @@
+#include <sys/stat.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* SHR_HUGEPAGE rings. the ring file is sized in whole huge pages,
+ * the slack going to the ring data, and shr_stat reports the huge
+ * page size. messages go through as usual. shr_init refuses it with
+ * SHR_MIRROR, and shr_open takes no SHR_HUGEPAGE.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define RING_SZ 100000
+#define NMSG 10000
+char msg[] = "1234567890abcdefghijklmnopqrstuvwxyz";
+
+int run(char *name, unsigned flags) {
+  char buf[sizeof(msg)];
+  struct shr_stat st;
+  unsigned n, bad = 0;
+  struct stat sb;
+  struct shr *w, *r;
+
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, flags) < 0) return -1;
+  if (stat(ring, &sb) < 0) return -1;
+
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) return -1;
+  r = shr_open(ring, SHR_RDONLY);
+  if (r == NULL) return -1;
+  if (shr_stat(r, &st, NULL) < 0) return -1;
+
+  printf("%s: huge pages %s, file %s, ring size %s\n", name,
+    (st.ps > (size_t)sysconf(_SC_PAGESIZE)) ? "yes" : "no",
+    (sb.st_size % st.ps) ? "not whole pages" : "whole pages",
+    (st.bn == RING_SZ) ? "as given" :
+    ((st.bn > RING_SZ) && (st.bn < st.ps)) ? "enlarged" : "wrong");
+  printf("%s: attributes %s\n", name,
+    (st.flags & SHR_HUGEPAGE) ? "hugepage" : "none");
+
+  /* many times round the ring */
+  for(n = 0; n < NMSG; n++) {
+    if (shr_write(w, msg, sizeof(msg)) != sizeof(msg)) return -1;
+    if (shr_read(r, buf, sizeof(buf)) != sizeof(msg)) return -1;
+    if (memcmp(buf, msg, sizeof(msg))) bad++;
+  }
+  printf("%s: %u messages, %s\n", name, n, bad ? "some bad" : "all good");
+
+  shr_close(w);
+  shr_close(r);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("SHR_HUGEPAGE", SHR_HUGEPAGE) < 0) goto done;
+  if (run("SHR_HUGEPAGE|SHR_MP", SHR_HUGEPAGE|SHR_MP) < 0) goto done;
+
+  unlink(ring);
+  printf("init with SHR_HUGEPAGE|SHR_MIRROR: %s\n",
+    (shr_init(ring, RING_SZ, SHR_HUGEPAGE|SHR_MIRROR) < 0) ?
+    "refused" : "accepted");
+
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, 0) < 0) goto done;
+  printf("open with SHR_HUGEPAGE: %s\n",
+    shr_open(ring, SHR_RDONLY|SHR_HUGEPAGE) ? "accepted" : "refused");
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,133 @@
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a client that dies with a message in flight. a writer that dies
+ * copying in (here, by a fault on its own buffer) leaves its message
+ * to be skipped by readers, and counted as dropped. a reader that dies
+ * holding a peeked message leaves its space to be reclaimed by writers;
+ * a non-blocking writer gets it, instead of spinning on it.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define RING_SZ 1024
+#define MSG_SZ 300
+
+int dead_writer(char *name, unsigned flags) {
+  struct shr *w, *r;
+  struct shr_stat st;
+  struct iovec io;
+  char buf[100];
+  ssize_t nr;
+  void *bad;
+  pid_t pid;
+
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, flags) < 0) return -1;
+  w = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK);
+  if (w == NULL) return -1;
+  r = shr_open(ring, SHR_RDONLY|SHR_NONBLOCK);
+  if (r == NULL) return -1;
+
+  if (shr_write(w, "one", 3) != 3) return -1;
+
+  /* a buffer that faults once the copy into the ring starts */
+  bad = mmap(NULL, 4096, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (bad == MAP_FAILED) return -1;
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    shr_close(w);
+    w = shr_open(ring, SHR_WRONLY);
+    if (w == NULL) _exit(1);
+    io.iov_base = bad;
+    io.iov_len = 5;
+    shr_writev(w, &io, 1);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  printf("%s: writer died mid-copy\n", name);
+
+  if (shr_write(w, "two", 3) != 3) return -1;
+  while ((nr = shr_read(r, buf, sizeof(buf))) > 0)
+    printf("%s: read %.*s\n", name, (int)nr, buf);
+  printf("%s: read %zd\n", name, nr);
+  if (shr_stat(r, &st, NULL) < 0) return -1;
+  printf("%s: dropped %zu\n", name,
+    (flags & SHR_FARM) ? shr_farm_stat(r, 0) : st.md);
+
+  munmap(bad, 4096);
+  shr_close(w);
+  shr_close(r);
+  unlink(ring);
+  return 0;
+}
+
+int dead_reader(char *name, unsigned flags) {
+  char msg[MSG_SZ], buf[MSG_SZ];
+  struct iovec iov[2];
+  struct shr *w, *r;
+  size_t niov;
+  ssize_t nr;
+  pid_t pid;
+  int i;
+
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, flags) < 0) return -1;
+  w = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK);
+  if (w == NULL) return -1;
+
+  memset(msg, 'a', sizeof(msg));
+  if (shr_write(w, msg, sizeof(msg)) != sizeof(msg)) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    r = shr_open(ring, SHR_RDONLY);
+    if (r == NULL) _exit(1);
+    niov = 2;
+    if (shr_read_peek(r, iov, &niov) != sizeof(msg)) _exit(1);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  printf("%s: reader died holding a peek\n", name);
+
+  /* the third of these needs the space of the peeked message */
+  for(i = 0; i < 3; i++) {
+    memset(msg, 'b' + i, sizeof(msg));
+    nr = shr_write(w, msg, sizeof(msg));
+    printf("%s: write %zd\n", name, nr);
+  }
+
+  r = shr_open(ring, SHR_RDONLY|SHR_NONBLOCK);
+  if (r == NULL) return -1;
+  while ((nr = shr_read(r, buf, sizeof(buf))) > 0)
+    printf("%s: read %zd bytes of %c\n", name, nr, buf[0]);
+  printf("%s: read %zd\n", name, nr);
+
+  shr_close(w);
+  shr_close(r);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (dead_writer("default", 0) < 0) goto done;
+  if (dead_writer("SHR_DROP", SHR_DROP) < 0) goto done;
+  if (dead_writer("SHR_FARM", SHR_FARM) < 0) goto done;
+  if (dead_reader("default", 0) < 0) goto done;
+  if (dead_reader("SHR_DROP", SHR_DROP) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
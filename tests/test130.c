@@ -0,0 +1,99 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* writers short of the space of a peeked message. a non-blocking
+ * writer gets 0, rather than spinning until the release. a blocking
+ * writer sleeps until the release wakes it. the same goes in SHR_DROP
+ * mode, where the writer can't take the space back either.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define RING_SZ 1024
+#define MSG_SZ 300
+
+char msg[MSG_SZ];
+
+int writer(char c) {
+  struct shr *w;
+
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) return -1;
+  memset(msg, c, sizeof(msg));
+  if (shr_write(w, msg, sizeof(msg)) != sizeof(msg)) return -1;
+  shr_close(w);
+  return 0;
+}
+
+/* write a, peek it, then fill the ring past it */
+int run(char *name, unsigned flags) {
+  struct shr *w, *r, *rp;
+  struct iovec iov[2];
+  char buf[MSG_SZ];
+  size_t niov;
+  ssize_t nr;
+  pid_t pid;
+  int i, st;
+
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, flags) < 0) return -1;
+  w = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK);
+  if (w == NULL) return -1;
+  rp = shr_open(ring, SHR_RDONLY);
+  if (rp == NULL) return -1;
+
+  if (writer('a') < 0) return -1;
+  niov = 2;
+  if (shr_read_peek(rp, iov, &niov) != sizeof(msg)) return -1;
+  printf("%s: peeked a\n", name);
+
+  /* the third of these needs the space of the peeked message */
+  for(i = 0; i < 3; i++) {
+    memset(msg, 'b' + i, sizeof(msg));
+    nr = shr_write(w, msg, sizeof(msg));
+    printf("%s: non-blocking write %c: %zd\n", name, 'b' + i, nr);
+  }
+
+  /* a blocking writer waits for the release */
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) _exit(writer('d') ? 1 : 0);
+  usleep(100000);
+  printf("%s: blocking write d: %s\n", name,
+    waitpid(pid, &st, WNOHANG) ? "done" : "waiting");
+  printf("%s: release %d\n", name, shr_read_release(rp));
+  waitpid(pid, &st, 0);
+  printf("%s: blocking write d: %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "done" : "failed");
+
+  r = shr_open(ring, SHR_RDONLY|SHR_NONBLOCK);
+  if (r == NULL) return -1;
+  while ((nr = shr_read(r, buf, sizeof(buf))) > 0)
+    printf("%s: read %zd bytes of %c\n", name, nr, buf[0]);
+  printf("%s: read %zd\n", name, nr);
+
+  shr_close(w);
+  shr_close(r);
+  shr_close(rp);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("default", 0) < 0) goto done;
+  if (run("SHR_MUTEX", SHR_MUTEX) < 0) goto done;
+  if (run("SHR_FUTEX", SHR_FUTEX) < 0) goto done;
+  if (run("SHR_DROP", SHR_DROP) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
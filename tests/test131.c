@@ -0,0 +1,105 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* SHR_MP writers and readers that die, or give up, mid-message. a
+ * writer that dies holding a reservation holds up no other writer,
+ * even a non-blocking one; readers skip its message, as they do one
+ * whose reservation was aborted. a reader that dies holding a peek
+ * leaves its space to be freed by the next reader.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+#define RING_SZ 1024
+#define MSG_SZ 300
+
+void drain(struct shr *r) {
+  char buf[MSG_SZ];
+  ssize_t nr;
+
+  while ((nr = shr_read(r, buf, sizeof(buf))) > 0)
+    printf("read %zd bytes: %.*s\n", nr, (int)(nr > 5 ? 5 : nr), buf);
+  printf("read %zd\n", nr);
+}
+
+int main() {
+  setlinebuf(stdout);
+  struct shr *w = NULL, *r = NULL;
+  struct shr_stat st;
+  struct iovec iov[2];
+  char msg[MSG_SZ];
+  size_t niov;
+  int rc = -1, i;
+  ssize_t nr;
+  pid_t pid;
+
+  unlink(ring);
+  if (shr_init(ring, RING_SZ, SHR_MP) < 0) goto done;
+  w = shr_open(ring, SHR_WRONLY|SHR_NONBLOCK);
+  if (w == NULL) goto done;
+  r = shr_open(ring, SHR_RDONLY|SHR_NONBLOCK);
+  if (r == NULL) goto done;
+
+  /* a writer dies holding a reservation */
+  pid = fork();
+  if (pid < 0) goto done;
+  if (pid == 0) {
+    shr_close(w);
+    w = shr_open(ring, SHR_WRONLY);
+    if (w == NULL) _exit(1);
+    if (shr_write_reserve(w, 5, iov) != 5) _exit(1);
+    memcpy(iov[0].iov_base, "dead!", 5);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  printf("writer died holding a reservation\n");
+  nr = shr_write(w, "after", 5);
+  printf("non-blocking write: %zd\n", nr);
+  drain(r);
+  if (shr_stat(r, &st, NULL) < 0) goto done;
+  printf("dropped %zu\n", st.md);
+
+  /* a reservation given up */
+  if (shr_write_reserve(w, 5, iov) != 5) goto done;
+  if (shr_write_abort(w) < 0) goto done;
+  printf("reservation aborted\n");
+  nr = shr_write(w, "after", 5);
+  printf("non-blocking write: %zd\n", nr);
+  drain(r);
+
+  /* a reader dies holding a peek */
+  memset(msg, 'a', sizeof(msg));
+  if (shr_write(w, msg, sizeof(msg)) != sizeof(msg)) goto done;
+  pid = fork();
+  if (pid < 0) goto done;
+  if (pid == 0) {
+    shr_close(r);
+    r = shr_open(ring, SHR_RDONLY);
+    if (r == NULL) _exit(1);
+    niov = 2;
+    if (shr_read_peek(r, iov, &niov) != sizeof(msg)) _exit(1);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  printf("reader died holding a peek\n");
+  for(i = 0; i < 3; i++) {
+    memset(msg, 'b' + i, sizeof(msg));
+    nr = shr_write(w, msg, sizeof(msg));
+    printf("non-blocking write %c: %zd\n", 'b' + i, nr);
+  }
+  drain(r);
+  nr = shr_write(w, msg, sizeof(msg));
+  printf("non-blocking write %c: %zd\n", msg[0], nr);
+  drain(r);
+  rc = 0;
+
+ done:
+  if (w) shr_close(w);
+  if (r) shr_close(r);
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
@@ -0,0 +1,82 @@
+#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a blocking reader waits at a reserved message, with another
+ * writer's message committed behind it. the reservation is aborted;
+ * the reader is woken, skips the void slot, and gets the message
+ * behind it. then the same with the reserving handle closed instead.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+int run(char *name, unsigned flags, int close_it) {
+  struct shr *w, *w2;
+  struct iovec iov[2];
+  pid_t pid;
+  int st;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, flags) < 0) return -1;
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) return -1;
+  w2 = shr_open(ring, SHR_WRONLY);
+  if (w2 == NULL) return -1;
+
+  if (shr_write_reserve(w, 5, iov) != 5) return -1;
+  if (shr_write(w2, "after", 5) != 5) return -1;
+
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    struct shr *r;
+    char buf[100];
+    ssize_t nr;
+
+    alarm(10);
+    r = shr_open(ring, SHR_RDONLY);
+    if (r == NULL) _exit(1);
+    nr = shr_read(r, buf, sizeof(buf));
+    if (nr != 5 || memcmp(buf, "after", 5)) _exit(1);
+    shr_close(r);
+    _exit(0);
+  }
+
+  usleep(100000);
+  printf("%s: reader %s\n", name,
+    waitpid(pid, &st, WNOHANG) ? "done" : "waiting");
+  if (close_it) {
+    shr_close(w);
+    printf("%s: reserving writer closed\n", name);
+  } else {
+    if (shr_write_abort(w) < 0) return -1;
+    printf("%s: reservation aborted\n", name);
+    shr_close(w);
+  }
+  waitpid(pid, &st, 0);
+  printf("%s: reader %s\n", name,
+    (WIFEXITED(st) && !WEXITSTATUS(st)) ? "got after" : "failed");
+
+  shr_close(w2);
+  unlink(ring);
+  return 0;
+}
+
+int main() {
+  setlinebuf(stdout);
+  int rc = -1;
+
+  if (run("default", 0, 0) < 0) goto done;
+  if (run("SHR_MP", SHR_MP, 0) < 0) goto done;
+  if (run("SHR_FUTEX", SHR_FUTEX, 0) < 0) goto done;
+  if (run("SHR_MUTEX", SHR_MUTEX, 0) < 0) goto done;
+  if (run("close", 0, 1) < 0) goto done;
+  rc = 0;
+
+ done:
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
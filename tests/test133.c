@@ -0,0 +1,62 @@
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include "shr.h"
+
+/* a monitor (SHR_MONITOR) looks at a SHR_SPSC ring in use. it
+ * opens alongside the ring's reader, where a second reader can't,
+ * sees the stats and clients, and can't read. with the monitor
+ * open, the reader can close and another open in its place.
+ */
+
+char *ring =  __FILE__ ".ring";
+
+int main() {
+  setlinebuf(stdout);
+  struct shr *w = NULL, *r = NULL, *r2, *m = NULL;
+  struct shr_client cl[4];
+  struct shr_stat st;
+  char buf[100];
+  size_t nc;
+  int rc = -1;
+
+  unlink(ring);
+  if (shr_init(ring, 1000, SHR_SPSC) < 0) goto done;
+  w = shr_open(ring, SHR_WRONLY);
+  if (w == NULL) goto done;
+  r = shr_open(ring, SHR_RDONLY);
+  if (r == NULL) goto done;
+  if (shr_write(w, "hello", 5) != 5) goto done;
+
+  r2 = shr_open(ring, SHR_RDONLY);
+  printf("second reader: %s\n", r2 ? "opened" : "refused");
+  if (r2) shr_close(r2);
+
+  m = shr_open(ring, SHR_RDONLY|SHR_MONITOR);
+  printf("monitor: %s\n", m ? "opened" : "refused");
+  if (m == NULL) goto done;
+  printf("monitor as writer: %s\n",
+    shr_open(ring, SHR_WRONLY|SHR_MONITOR) ? "opened" : "refused");
+
+  if (shr_stat(m, &st, NULL) < 0) goto done;
+  printf("monitor: messages-written %zu, messages-ready %zu\n", st.mw, st.mu);
+  nc = sizeof(cl) / sizeof(*cl);
+  if (shr_stat_clients(m, cl, &nc) < 0) goto done;
+  printf("monitor: clients %zu\n", nc);
+  printf("monitor: read %zd\n", shr_read(m, buf, sizeof(buf)));
+
+  shr_close(r);
+  r = shr_open(ring, SHR_RDONLY);
+  printf("new reader: %s\n", r ? "opened" : "refused");
+  if (r == NULL) goto done;
+  printf("new reader: read %zd\n", shr_read(r, buf, sizeof(buf)));
+  rc = 0;
+
+ done:
+  if (m) shr_close(m);
+  if (r) shr_close(r);
+  if (w) shr_close(w);
+  unlink(ring);
+  printf("end\n");
+  return rc;
+}
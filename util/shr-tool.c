@@ -134,12 +134,18 @@ void usage() {
                  "  -s size        size with kmgt suffix\n"
                  "  -A file        copy file into app-data\n"
                  "  -N maxmsgs     set max number of messages\n"
-                 "  -m dfksl       flags (combinable, default: 0)\n"
+                 "  -m dfkslxopuch flags (combinable, default: 0)\n"
                  "      d          drop unread frames when full\n"
                  "      f          farm of independent readers\n"
                  "      k          keep ring as-is if it exists\n"
                  "      l          lock into memory when opened\n"
                  "      s          sync after each i/o\n"
+                 "      x          mutex ring lock (not file lock)\n"
+                 "      o          one writer, one reader (lock-free i/o)\n"
+                 "      p          many writers (lock-free space reservation)\n"
+                 "      u          blocking handles wait on futexes\n"
+                 "      c          data mapped twice; contiguous messages\n"
+                 "      h          sized and mapped in huge pages\n"
                  "\n"
                  "status options\n"
                  "--------------\n"
@@ -910,8 +916,9 @@ int main(int argc, char *argv[]) {
   char unit, *c, *app_data, *cmd, line[1000], opts[100],
     *ring1=NULL, *ring2=NULL, *data, *sub;
   struct epoll_event ev;
+  struct shr_client clients[128], *cl;
   struct shr_stat stat;
-  size_t app_len = 0;
+  size_t app_len = 0, nc, i;
   cfg.prog = argv[0];
   struct statfs sf;
   struct stat sb;
@@ -998,6 +1005,12 @@ int main(int argc, char *argv[]) {
              case 'f': cfg.flags |= SHR_FARM; break;
              case 's': cfg.flags |= SHR_SYNC; break;
              case 'l': cfg.flags |= SHR_MLOCK; break;
+             case 'x': cfg.flags |= SHR_MUTEX; break;
+             case 'o': cfg.flags |= SHR_SPSC; break;
+             case 'p': cfg.flags |= SHR_MP; break;
+             case 'u': cfg.flags |= SHR_FUTEX; break;
+             case 'c': cfg.flags |= SHR_MIRROR; break;
+             case 'h': cfg.flags |= SHR_HUGEPAGE; break;
              default: usage(); break;
            }
            c++;
@@ -1097,7 +1110,7 @@ int main(int argc, char *argv[]) {
 
     case mode_status:
       one_shot=1;
-      cfg.shr = shr_open(cfg.ring, SHR_RDONLY);
+      cfg.shr = shr_open(cfg.ring, SHR_RDONLY|SHR_MONITOR);
       if (cfg.shr == NULL) goto done;
       rc = shr_stat(cfg.shr, &stat, NULL);
       if (rc < 0) goto done;
@@ -1110,9 +1123,10 @@ int main(int argc, char *argv[]) {
              " ring-size %ld\n"
              " bytes-ready %ld\n"
              " max-messages %ld\n"
-             " messages-ready %ld\n",
+             " messages-ready %ld\n"
+             " page-size %zu\n",
          stat.bw, stat.br, stat.bd, stat.mw, stat.mr, stat.md, stat.bn,
-         stat.bu, stat.mm, stat.mu);
+         stat.bu, stat.mm, stat.mu, stat.ps);
 
       printf(" attributes ");
       if (stat.flags == 0)          printf("none");
@@ -1121,8 +1135,29 @@ int main(int argc, char *argv[]) {
       if (stat.flags & SHR_FARM)    printf("farm ");
       if (stat.flags & SHR_MLOCK)   printf("mlock ");
       if (stat.flags & SHR_SYNC)    printf("sync ");
+      if (stat.flags & SHR_MUTEX)   printf("mutex ");
+      if (stat.flags & SHR_SPSC)    printf("spsc ");
+      if (stat.flags & SHR_MP)      printf("mp ");
+      if (stat.flags & SHR_FUTEX)   printf("futex ");
+      if (stat.flags & SHR_MIRROR)  printf("mirror ");
+      if (stat.flags & SHR_HUGEPAGE) printf("hugepage ");
       printf("\n");
 
+      nc = sizeof(clients) / sizeof(*clients);
+      rc = shr_stat_clients(cfg.shr, clients, &nc);
+      if (rc < 0) goto done;
+      printf(" clients %zu\n", nc);
+      for(i = 0; i < nc; i++) {
+        cl = &clients[i];
+        if (cl->flags & SHR_WRONLY)
+          printf("  pid %d writer: bytes-written %zu messages-written %zu"
+                 " bytes-dropped %zu messages-dropped %zu\n", (int)cl->pid,
+                 cl->bw, cl->mw, cl->bd, cl->md);
+        else
+          printf("  pid %d reader: bytes-read %zu messages-read %zu\n",
+                 (int)cl->pid, cl->br, cl->mr);
+      }
+
       app_data = NULL;
       rc = shr_appdata(cfg.shr, (void**)&app_data, NULL, &app_len);
       printf(" app-data %zu\n", app_len);